@@ -0,0 +1,9 @@
+// Comments that look nested. Every line here is left inside a block comment
+// if it started in one, and outside if it didn't, so a comment opened above
+// reaches all the way down and each row has to be highlighted again.
+int depth = 0; // one /* two /* three */ four /*
+int widths[] = { 1, 2, 3 }; // /* /* /* */ /* /* */ /*
+static int nest(int level) { // level */ and /* deeper /* still */ /*
+  return level > 0 ? nest(level - 1) + 1 : 0; // */ back out /* and in again
+} // /* /* /* /* /* /* /* /* /* /* */ /*
+char* opener = "/"; // a "/*" in a string */ comment /* and code
@@ -0,0 +1 @@
+static const unsigned char table[]={0x1f,0x8b,0x08,0x00,0x00,0x00,0x00,0x00,0x02,0x03,0xed,0x5d,0x6b,0x73,0xdb,0x36};/* packed */static int lookup(int key){int low=0,high=sizeof(table)-1;while(low<=high){int middle=(low+high)/2;if(table[middle]<key)low=middle+1;else if(table[middle]>key)high=middle-1;else return middle;}return -1;}static char*names[]={"alpha","beta","gamma","delta","epsilon"};int count_names(void){int total=0;for(int i=0;i<5;i++)total+=lookup(i)!=-1;return total;}
\ No newline at end of file
@@ -6,19 +6,61 @@
 #define TAB_STOP   8
 #define QUIT_TIMES 3
 
+#define INDEX_SLICE         (1 << 20)
+#define COMMENT_SLICE       (1 << 16)
+#define FRAME_COMMENT_SLICE 1024
+#define SEARCH_RUN          (1 << 20)
+#define SEARCH_PUBLISH      10
+#define ESCAPE_TIMEOUT      50
+#define REPLY_TIMEOUT       1000
+#define MESSAGE_TIMEOUT     5
+#define SAVE_BATCH          1024
+#define SAVE_CHUNK          (1 << 23)
+#define SAVE_PROGRESS       100
+#define JOURNAL_COMMIT      200
+#define JOURNAL_VERSION     2
+#define POOL_BLOCK          16
+#define POOL_CLASSES        12
+#define POOL_CHUNK          (1 << 20)
+#define CHUNK_ROW           (1 << 16)
+#define CHUNK_SIZE          (1 << 12)
+#define CHUNK_OVERLAP       64
+#define CHECKPOINT          256
+#define KEYWORD_LIMIT       32
+
+#include <assert.h>
 #include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// --bench-memory reads the heap's size with mallinfo2, which only glibc
+// 2.33 and later have.
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+#define HEAP_STATS
+#include <malloc.h>
+#endif
+
 #define CTRL_KEY(k) ((k) & 0x1F)
 
 #define length(array) (sizeof(array) / sizeof((array)[0]))
@@ -26,6 +68,49 @@
 #define HIGHLIGHT_NUMBERS (1 << 0)
 #define HIGHLIGHT_STRINGS (1 << 1)
 
+// A byte trie of a syntax's keywords. Node 0 is the root, so a zero in next
+// means there is no child. Nodes that end a keyword hold the keyword's
+// position in the list, since the first keyword listed wins.
+typedef struct {
+  unsigned short next[256];
+  short          keyword;
+  char           highlight;
+} KeywordNode;
+
+// Where a token starts, which decides what it can be. In normal text, one
+// is added after a seperator and two after a number.
+#define CONTEXT_NORMAL  0
+#define CONTEXT_COMMENT 4
+#define CONTEXT_DOUBLE  5
+#define CONTEXT_SINGLE  6
+#define CONTEXT_LINE    7
+
+// What a run of bytes lexes as: how many bytes it takes, how they are drawn
+// and the context the next token starts in.
+typedef struct {
+  unsigned char size;
+  unsigned char highlight;
+  unsigned char context;
+} Token;
+
+// A syntax compiled into a state table, so that lexing takes a lookup per
+// byte, and another for each byte of a word that only started like a
+// keyword. Bytes that the syntax can't tell apart share a class, and the table
+// has a column per class. The first states start a token in each context.
+// Stepping from one ends on a negative entry, the complement of the token
+// found, or back on a start state when the token needs nothing done. Where
+// the text ends, a state's entry in `ends` is used instead.
+typedef struct {
+  unsigned char classes[256];
+  int           class_count;
+  int*          next;
+  int*          ends;
+  int           state_count;
+  int           state_capacity;
+  Token*        tokens;
+  int           token_count;
+} LexTable;
+
 typedef struct {
   char*  file_type;
   char** file_match;
@@ -34,50 +119,49 @@ typedef struct {
   char*  multi_line_comment_start;
   char*  multi_line_comment_end;
   int    flags;
+
+  // Filled in by compile_syntaxes.
+  KeywordNode* keyword_nodes;
+  LexTable*    table;
+  int          single_line_comment_start_size;
+  int          multi_line_comment_start_size;
+  int          multi_line_comment_end_size;
 } Syntax;
 
-static char* c_extensions[] = { ".c", ".h", ".cpp", NULL };
-static char* c_keywords[] = {
-  "switch", "if",      "while",   "for",    "break", "continue",  "return",  "else",
-  "struct", "union",   "typedef", "static", "enum",  "class",     "case",    "extern",
-  "int|",   "long|",   "double|", "float|", "char|", "unsigned|", "signed|", "void|",
-  NULL,
-};
+// Syntaxes are read by read_syntax from files in $EDITOR1_SYNTAX or
+// ~/.editor1/syntax, and these are built in after them. The first one to
+// match a file name is used.
+static char* builtin_syntaxes[] = {
+  "syntax c\n"
+  "files .c .h .cpp\n"
+  "comment //\n"
+  "comments /* */\n"
+  "highlight numbers strings\n"
+  "keywords switch if while for break continue return else struct union typedef static enum class case extern\n"
+  "keywords2 int long double float char unsigned signed void\n",
 
-static char* haskell_extensions[] = { ".hs", NULL };
-static char* haskell_keywords[] = {
-  "!",        "'",         "\"",      "-",       "->",        "::",       ";",       "<-",
-  ",",        "=",         "=>",      ">",       "?",         "#",        "*",       "@",
-  "\\",       "_",         "as|",     "case|",   "of|",       "class|",   "data|",   "family|",
-  "default|", "deriving|", "do|",     "forall|", "instance|", "foreign|", "hiding|", "if|",
-  "then|",    "else|",     "import|", "infix|",  "infixl|",   "infixr|",  "let|",    "in|",
-  "module|",  "newtype|",  "type|",   "where|",  NULL,
+  "syntax haskell\n"
+  "files .hs\n"
+  "comment --\n"
+  "comments {- -}\n"
+  "highlight numbers strings\n"
+  "keywords ! ' \" - -> :: ; <- , = => > ? # * @ \\ _\n"
+  "keywords2 as case of class data family default deriving do forall instance foreign hiding if then else\n"
+  "keywords2 import infix infixl infixr let in module newtype type where\n",
 };
 
-static Syntax syntaxes[] = {
-  {
-    "c",
-    c_extensions,
-    c_keywords,
-    "//",
-    "/*",
-    "*/",
-    HIGHLIGHT_NUMBERS | HIGHLIGHT_STRINGS
-  },
-  {
-    "haskell",
-    haskell_extensions,
-    haskell_keywords,
-    "--",
-    "{-",
-    "-}",
-    HIGHLIGHT_NUMBERS | HIGHLIGHT_STRINGS
-  },
-};
+static Syntax* syntaxes;
+static int     syntax_count;
 
 static struct termios original;
 
+// The terminal is read from stdin and drawn on stdout, unless a replay
+// stands in for it.
+static int terminal_input  = STDIN_FILENO;
+static int terminal_output = STDOUT_FILENO;
+
 static void clear_screen();
+static void finish_frame();
 
 static void die(const char* s) {
   clear_screen();
@@ -86,6 +170,8 @@ static void die(const char* s) {
 }
 
 static void disable_raw_mode() {
+  finish_frame();
+  write(STDOUT_FILENO, "\x1b[?2004l", 8); // Stop bracketing pastes.
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &original) == -1) {
     die("tcsetattr");
   }
@@ -104,89 +190,261 @@ static void enable_raw_mode() {
   raw.c_lflag &= ~(ECHO  | ICANON | IEXTEN | ISIG);
   
   raw.c_cc[VMIN]  = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = 0;
   
   if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) {
       die("tcsetattr");
   }
+  write(STDOUT_FILENO, "\x1b[?2004h", 8); // Bracket pastes.
+
+  // Frames are written without blocking, so a slow terminal never holds up
+  // reading keys. They go through the editor's own opening of the terminal,
+  // since stdout's is shared with the shell, and would be left non-blocking
+  // if the editor were killed. If there's no terminal to open, frames are
+  // written to stdout and block.
+  char* terminal = ttyname(STDOUT_FILENO);
+  int   output   = terminal == NULL ? -1 : open(terminal, O_WRONLY | O_NOCTTY | O_NONBLOCK);
+  if (output != -1) {
+    terminal_output = output;
+  }
 }
 
+// Keys that aren't a byte of input come after all the bytes, so that no
+// byte typed or pasted can be taken for one.
 #define BACKSPACE   0x7F
-#define ARROW_UP    0xF0
-#define ARROW_DOWN  0xF1
-#define ARROW_RIGHT 0xF2
-#define ARROW_LEFT  0xF3
-#define PAGE_UP     0xF4
-#define PAGE_DOWN   0xF5
-#define HOME_KEY    0xF6
-#define END_KEY     0xF7
-#define DELETE_KEY  0xF8
+#define ARROW_UP    0x100
+#define ARROW_DOWN  0x101
+#define ARROW_RIGHT 0x102
+#define ARROW_LEFT  0x103
+#define PAGE_UP     0x104
+#define PAGE_DOWN   0x105
+#define HOME_KEY    0x106
+#define END_KEY     0x107
+#define DELETE_KEY  0x108
+#define WAKE_KEY    0x109
+#define PASTE_KEY   0x10A
+
+#define PROFILE_READ_KEY  0
+#define PROFILE_HIGHLIGHT 1
+#define PROFILE_RENDER    2
+#define PROFILE_REFRESH   3
+#define PROFILE_WRITE     4
+#define PROFILES          5
+#define PROFILE_BUCKETS   36
+
+// Calls on the way from a key to the screen are counted and timed, into a
+// histogram by powers of two of nanoseconds. Timing a call costs two reads
+// of the clock. SIGUSR1 writes it all out to a file.
+typedef struct {
+  long calls;
+  long nanoseconds;
+  long buckets[PROFILE_BUCKETS];
+} Profile;
+
+static char* profile_names[] = { "read_key", "highlight_row", "render_row", "refresh_screen", "write" };
+
+static Profile profiles[PROFILES];
+
+static long profile_clock() {
+  struct timespec now = {};
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static void profile(int which, long start) {
+  long     elapsed = profile_clock() - start;
+  Profile* counts  = &profiles[which];
+  int      bucket  = elapsed > 0 ? 63 - __builtin_clzl(elapsed) : 0;
+  if (bucket >= PROFILE_BUCKETS) {
+    bucket = PROFILE_BUCKETS - 1;
+  }
+  counts->calls++;
+  counts->nanoseconds += elapsed;
+  counts->buckets[bucket]++;
+}
+
+// Signal handlers only take note, and wake the editor through the same pipe
+// as worker threads so that the main loop deals with the signal.
+static volatile sig_atomic_t profile_requested;
+static volatile sig_atomic_t window_resized;
+static int                   signal_wake = -1;
+
+// Leaves errno as it was for whatever the signal interrupted.
+static void wake_from_signal() {
+  int saved = errno;
+  write(signal_wake, "", 1);
+  errno = saved;
+}
+
+static void request_profile(int number) {
+  (void) number;
+  profile_requested = 1;
+  wake_from_signal();
+}
+
+static void note_resize(int number) {
+  (void) number;
+  window_resized = 1;
+  wake_from_signal();
+}
+
+// Bytes read from the terminal that haven't been decoded into keys yet.
+// Whatever is available is read in one go, so a paste or a burst of repeated
+// keys costs a single read.
+static unsigned char input[4096];
+static int           input_start;
+static int           input_end;
+
+// Waits up to `timeout` milliseconds for more input, or forever if it's
+// negative, and returns whether any arrived.
+static int fill_input(int timeout) {
+  if (input_start > 0) {
+    memmove(input, &input[input_start], input_end - input_start);
+    input_end  -= input_start;
+    input_start = 0;
+  }
+  if (input_end == sizeof(input)) {
+    return 0;
+  }
+
+  struct pollfd terminal = { terminal_input, POLLIN, 0 };
+  int           ready    = poll(&terminal, 1, timeout);
+  if (ready == -1 && errno != EINTR) {
+    die("poll");
+  }
+  if (ready <= 0) {
+    return 0;
+  }
+
+  int bytes_read = read(terminal_input, &input[input_end], sizeof(input) - input_end);
+  if (bytes_read == -1 && errno != EAGAIN) {
+    die("read");
+  }
+  if (bytes_read <= 0) {
+    return 0;
+  }
+  input_end += bytes_read;
+  return 1;
+}
+
+static int key_pending() {
+  return input_start < input_end || fill_input(0);
+}
+
+static int read_byte(char* byte, int timeout) {
+  if (input_start == input_end && !fill_input(timeout)) {
+    return 0;
+  }
+  *byte = input[input_start];
+  input_start++;
+  return 1;
+}
+
+// Decodes the key at the start of `size` bytes into *key, and returns how
+// many bytes it took, or 0 if an escape sequence is cut off. Escape
+// sequences that aren't known come out as a plain escape.
+static int decode_key(unsigned char* bytes, int size, int* key) {
+  *key = bytes[0];
+  if (bytes[0] != 0x1B) {
+    return 1;
+  }
+  if (size < 2) {
+    return 0;
+  }
+
+  if (bytes[1] == 'O') {
+    if (size < 3) {
+      return 0;
+    }
+    if (bytes[2] == 'H') {
+      *key = HOME_KEY;
+    }
+    if (bytes[2] == 'F') {
+      *key = END_KEY;
+    }
+    return 3;
+  }
+
+  if (bytes[1] != '[') {
+    return 1;
+  }
+
+  // Parameters and intermediates run up to a final byte from '@' to '~'.
+  int end = 2;
+  while (end < size && (bytes[end] < '@' || bytes[end] > '~')) {
+    end++;
+  }
+  if (end == size) {
+    return 0;
+  }
+
+  char final     = bytes[end];
+  int  parameter = isdigit(bytes[2]) ? atoi((char*) &bytes[2]) : 0;
+  if (final == '~') {
+    if (parameter == 5) {
+      *key = PAGE_UP;
+    }
+    if (parameter == 6) {
+      *key = PAGE_DOWN;
+    }
+    if (parameter == 1 || parameter == 7) {
+      *key = HOME_KEY;
+    }
+    if (parameter == 4 || parameter == 8) {
+      *key = END_KEY;
+    }
+    if (parameter == 3) {
+      *key = DELETE_KEY;
+    }
+    if (parameter == 200) {
+      *key = PASTE_KEY;
+    }
+  }
+  if (final == 'A') {
+    *key = ARROW_UP;
+  }
+  if (final == 'B') {
+    *key = ARROW_DOWN;
+  }
+  if (final == 'C') {
+    *key = ARROW_RIGHT;
+  }
+  if (final == 'D') {
+    *key = ARROW_LEFT;
+  }
+  if (final == 'H') {
+    *key = HOME_KEY;
+  }
+  if (final == 'F') {
+    *key = END_KEY;
+  }
+  return end + 1;
+}
 
+// Reads the next key, waiting for it if none is buffered. An escape that
+// isn't followed by the rest of a sequence within ESCAPE_TIMEOUT is taken
+// to be the escape key itself.
 static int read_key() {
-  int key        = 0;
-  int bytes_read = 0;
-  while (bytes_read != 1) {
-   bytes_read = read(STDIN_FILENO, &key, 1);
-   if (bytes_read == -1 && errno != EAGAIN) {
-     die("read");
-   }
-  }
-  if (key == 0x1B) {
-    char sequence[3] = {};
-    if (read(STDIN_FILENO, &sequence[0], 1) == 1) {
-      if (read(STDIN_FILENO, &sequence[1], 1) == 1) {
-	if (sequence[0] == '[') {
-	  if ('0' <= sequence[1] && sequence[1] <= '9') {
-	    if (read(STDIN_FILENO, &sequence[2], 1) == 1) {
-	      if (sequence[2] == '~') {
-		if (sequence[1] == '5') {
-		  key = PAGE_UP;
-		}
-		if (sequence[1] == '6') {
-		  key = PAGE_DOWN;
-		}
-		if (sequence[1] == '1' || sequence[1] == '7') {
-		  key = HOME_KEY;
-		}
-		if (sequence[1] == '4' || sequence[1] == '8') {
-		  key = END_KEY;
-		}
-		if (sequence[1] == '3') {
-		  key = DELETE_KEY;
-		}
-	      }
-	    }
-	  }
-	  if (sequence[1] == 'A') {
-	    key = ARROW_UP;
-	  }
-	  if (sequence[1] == 'B') {
-	    key = ARROW_DOWN;
-	  }
-	  if (sequence[1] == 'C') {
-	    key = ARROW_RIGHT;
-	  }
-	  if (sequence[1] == 'D') {
-	    key = ARROW_LEFT;
-	  }
-	  if (sequence[1] == 'H') {
-	    key = HOME_KEY;
-	  }
-	  if (sequence[1] == 'F') {
-	    key = END_KEY;
-	  }
-	} else if (sequence[0] == 'O') {
-	  if (sequence[1] == 'H') {
-	    key = HOME_KEY;
-	  }
-	  if (sequence[1] == 'F') {
-	    key = END_KEY;
-	  }	  
-	}
-      }
+  long start = profile_clock();
+  while (1) {
+    int key  = 0;
+    int used = 0;
+    if (input_start < input_end) {
+      used = decode_key(&input[input_start], input_end - input_start, &key);
+    }
+    if (used > 0) {
+      input_start += used;
+      profile(PROFILE_READ_KEY, start);
+      return key;
+    }
+
+    int escape = input_start < input_end;
+    if (!fill_input(escape ? ESCAPE_TIMEOUT : -1) && escape) {
+      input_start++;
+      profile(PROFILE_READ_KEY, start);
+      return 0x1B;
     }
   }
-  return key;
 }
 
 static int get_cursor_position(int* rows, int* columns) {
@@ -195,7 +453,7 @@ static int get_cursor_position(int* rows, int* columns) {
 
   if (write(STDOUT_FILENO, "\x1b[6n", 4) == 4) {
     for (int i = 0; i < sizeof(buffer) - 1; i++) {
-      if (read(STDIN_FILENO, &buffer[i], 1) != 1 || buffer[i] == 'R') {
+      if (!read_byte(&buffer[i], REPLY_TIMEOUT) || buffer[i] == 'R') {
 	break;
       }
     }
@@ -246,6 +504,68 @@ static void buffer_append(Buffer* buffer, char* message, int message_size) {
   }
 }
 
+// The frame being written to the terminal, and how much of it is out. What
+// the terminal doesn't take right away is written as it drains, and frames
+// due before then are put off and drawn as one once it has.
+static Buffer* frame;
+static int     frame_written;
+
+static int frame_pending() {
+  return frame != NULL && frame_written < frame->size;
+}
+
+// Writes as much of the frame as the terminal takes without blocking, and
+// returns whether all of it is out. A terminal that fails is given up on.
+static int flush_frame() {
+  while (frame_pending()) {
+    long    start   = profile_clock();
+    ssize_t written = write(terminal_output, &frame->data[frame_written], frame->size - frame_written);
+    profile(PROFILE_WRITE, start);
+    if (written == -1 && errno == EINTR) {
+      continue;
+    }
+    if (written == -1 && errno == EAGAIN) {
+      return 0;
+    }
+    frame_written = written == -1 ? frame->size : frame_written + written;
+  }
+  return 1;
+}
+
+// Waits for the rest of the frame to go out, before anything else is written
+// to the terminal directly.
+static void finish_frame() {
+  while (!flush_frame()) {
+    struct pollfd terminal = { terminal_output, POLLOUT, 0 };
+    poll(&terminal, 1, -1);
+  }
+}
+
+// Reads the text of a bracketed paste, after PASTE_KEY, up to the sequence
+// that ends it. Anything after that is left for read_key.
+static void read_paste(Buffer* paste) {
+  char* end      = "\x1b[201~";
+  int   end_size = strlen(end);
+
+  paste->size = 0;
+  while (1) {
+    if (input_start == input_end) {
+      fill_input(-1);
+    }
+    int from = paste->size > end_size - 1 ? paste->size - (end_size - 1) : 0;
+    buffer_append(paste, (char*) &input[input_start], input_end - input_start);
+    input_start = input_end;
+
+    char* found = memmem(&paste->data[from], paste->size - from, end, end_size);
+    if (found != NULL) {
+      int after    = paste->data + paste->size - (found + end_size);
+      input_start -= after;
+      paste->size  = found - paste->data;
+      return;
+    }
+  }
+}
+
 #define HIGHLIGHT_NORMAL   0
 #define HIGHLIGHT_COMMENT  1
 #define HIGHLIGHT_COMMENTS 2
@@ -255,15 +575,124 @@ static void buffer_append(Buffer* buffer, char* message, int message_size) {
 #define HIGHLIGHT_NUMBER   6
 #define HIGHLIGHT_MATCH    7
 
+// What the terminal shows in one position. A style is the SGR code of the
+// foreground color, plus STYLE_INVERTED when colors are inverted. Cells with
+// a zero symbol are unknown and always redrawn.
 typedef struct {
-  int   index;
-  char* data;
+  char          symbol;
+  unsigned char style;
+} Cell;
+
+#define STYLE_NORMAL   39
+#define STYLE_INVERTED 0x80
+
+// Highlights are kept as runs of text in the same class. Text outside of
+// any span is HIGHLIGHT_NORMAL, so plain rows need no spans at all.
+typedef struct {
+  int start;
+  int size;
+  int highlight;
+} Span;
+
+typedef struct {
+  Span* data;
+  int   size;
+  int   capacity;
+} Spans;
+
+// Where lexing stopped, so that it can pick up again from there. The first
+// `skip` bytes after it were taken by a token that ran over, and are drawn
+// in skip_highlight.
+typedef struct {
+  int in_comment;
+  int in_string;
+  int in_number;
+  int previous_seperator;
+  int line_comment;
+  int skip;
+  int skip_highlight;
+} Lexer;
+
+// A piece of a long row, with its own rendered text and highlights, which
+// are current while the stamp matches the editor's generation. Highlights
+// are relative to the chunk's first column. A chunk without tabs renders as
+// its own text, and one with tabs keeps the column of every CHECKPOINT
+// bytes of it, also counted from its first column, so that columns are
+// found without going over all of it.
+typedef struct {
+  int   start;
   int   size;
+  int   tabs;
+  int   column;
+  int*  checkpoints;
+  int   checkpoints_capacity;
+  Lexer lexer;
+
+  int   stamp;
   char* rendered;
   int   rendered_size;
-  char* highlights;
-  int   open_comment;
-} Row;
+  int   rendered_capacity;
+  Spans highlights;
+} Chunk;
+
+// Long rows are handled as chunks, so that an edit only renders and
+// highlights again the chunks it touched and drawing only looks at the
+// chunks on screen. The chunk after the last one ends the row, with the
+// column and lexer state the row ends in.
+//
+// Chunks before `laid_out` have a current column, which an edit shifts
+// rather than drops, and chunks before `lexed` have a current lexer state.
+// The states before `known` were all worked out in one pass, so once
+// lexing again past the `edited` chunks comes up with one of them, the
+// rest still hold.
+typedef struct {
+  Chunk* data;
+  int    size;
+  int    capacity;
+  int    laid_out;
+  int    lexed;
+  int    known;
+  int    edited;
+  int    in_comment;
+  int    generation;
+} Chunks;
+
+// Rows are kept in a treap ordered by position, so every row is also a node
+// that knows how many rows its subtree holds. Looking up, inserting and
+// deleting a row are all O(log n).
+//
+// Trees can share nodes, which makes taking a snapshot of the rows as cheap
+// as holding on to the root. A node is only changed in place while a single
+// parent refers to it, and is copied along with its path from the root
+// otherwise.
+typedef struct Row Row;
+
+struct Row {
+  Row*     left;
+  Row*     right;
+  int      count;
+  unsigned priority;
+  int      references;
+
+  char*    data;
+  int      size;
+  int      capacity;
+  int      mapped;
+  int      open_comment;
+
+  // Rendered text and highlights are only filled in when a row is drawn, and
+  // are current while the stamp matches the editor's generation. A row
+  // without tabs renders as its own text, so it is plain and its rendered
+  // text is its data, until it is changed. Long rows keep theirs in chunks
+  // instead.
+  int      stamp;
+  int      plain;
+  char*    rendered;
+  int      rendered_size;
+  int      rendered_capacity;
+  Spans    highlights;
+  Chunks*  chunks;
+};
 
 typedef struct {
   Row* data;
@@ -271,13 +700,174 @@ typedef struct {
   int  capacity;
 } Rows;
 
+typedef struct {
+  int y;
+  int x;
+} Match;
+
+typedef struct {
+  Match* data;
+  int    size;
+  int    capacity;
+} Matches;
+
+// A search running on a worker thread over a snapshot of the rows. It starts
+// on row `origin` and wraps around to it, so that matches on screen are found
+// first, and passes what it finds to the editor in batches through `found`.
+// When filtering, it only checks which of the matches of a shorter query
+// still match.
+typedef struct {
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  atomic_int      cancelled;
+  int             wake;
+
+  Row*    root;
+  int     row_count;
+  char*   query;
+  int     query_size;
+  int     origin;
+  int     filtering;
+  Matches previous;
+
+  Matches found;
+  int     done;
+  int     notified;
+} Search;
+
+// Rows are written straight from their own buffers, a batch of pieces at a
+// time. Consecutive rows that still point into the mapped file, and the
+// newlines between them, go out as one piece. Pieces are flushed every
+// SAVE_CHUNK bytes, and the editor is woken up every SAVE_PROGRESS
+// milliseconds to show how far along it is.
+typedef struct {
+  int             fd;
+  char*           map_end;
+  struct iovec    pieces[SAVE_BATCH];
+  int             piece_count;
+  long            written;
+  int             failed;
+
+  atomic_long     flushed;
+  int             wake;
+  struct timespec woken;
+} Writer;
+
+// A save running on a worker thread from a snapshot of the rows, along with
+// the part of the mapped file that hadn't been split into rows yet. `edits`
+// is the editor's count of edits when the snapshot was taken.
+typedef struct {
+  pthread_t       thread;
+  Writer          writer;
+  Row*            root;
+  char*           tail;
+  size_t          tail_size;
+  char*           file_name;
+  char            temporary_name[PATH_MAX];
+  int             edits;
+  long            journal_offset;
+  struct timespec start;
+
+  atomic_long     total;
+  atomic_int      done;
+  int             error;
+  double          milliseconds;
+} Save;
+
+// The primitive edits, as they're journaled and kept for undo. Each one has
+// an operation, two numbers and some text, and carries what it replaced so
+// that it can be undone:
+//
+//   EDIT_INSERT_CHAR    row, column, the character
+//   EDIT_DELETE_CHAR    row, column, the character
+//   EDIT_INSERT_ROW     row, 0, the text
+//   EDIT_DELETE_ROWS    row, count, the rows' text joined by newlines
+//   EDIT_APPEND_STRING  row, size before, the text
+//   EDIT_TRUNCATE_ROW   row, size after, the text cut off
+//   EDIT_INSERT_TEXT    row, column, the text
+#define EDIT_INSERT_CHAR   1
+#define EDIT_DELETE_CHAR   2
+#define EDIT_INSERT_ROW    3
+#define EDIT_DELETE_ROWS   4
+#define EDIT_APPEND_STRING 5
+#define EDIT_TRUNCATE_ROW  6
+#define EDIT_INSERT_TEXT   7
+
+typedef struct {
+  int operation;
+  int a;
+  int b;
+  int text_size;
+} Edit;
+
+// The edits made by one key, which undo and redo as a whole, with where the
+// cursor was before and after. Characters typed one after another all go
+// into one step.
+typedef struct {
+  int start;
+  int end;
+  int cursor_y;
+  int cursor_x;
+  int after_y;
+  int after_x;
+  int typing;
+} Step;
+
+// Edits for undo are kept back to back in one log, each followed by its
+// text, so recording an edit allocates nothing of its own. Steps before
+// `current` are done and the ones after it were undone, until a new edit
+// throws them away.
+typedef struct {
+  Buffer log;
+  Step*  steps;
+  int    step_count;
+  int    step_capacity;
+  int    current;
+  int    open;
+  int    paused;
+  int    cursor_y;
+  int    cursor_x;
+} History;
+
+typedef struct Replay Replay;
+
 typedef struct {
   char*  file_name;
 
+  // The file is mapped rather than read, and unedited rows point straight
+  // into the mapping. Rows past map_indexed haven't been split off yet.
+  char*  map;
+  size_t map_size;
+  size_t map_indexed;
+
   Buffer buffer;
+  Buffer paste;
   int    rows;
   int    columns;
 
+  // The frame being drawn and the one the terminal shows, each with a line
+  // for every row plus the status and message bars. Only cells that differ
+  // between them are written out.
+  Cell*  screen;
+  Cell*  shown;
+  int    shown_offset;
+
+  // Bytes written to the terminal by the last frame and by all of them.
+  int    frame_bytes;
+  long   frames;
+  long   bytes_written;
+  int    frame_stats;
+
+  // Whether a frame was put off while the terminal was still taking the
+  // last one.
+  int    frame_owed;
+
+  // What the last frame cost, shown in the message bar while the overlay is
+  // on.
+  int    overlay;
+  long   frame_nanoseconds;
+  int    frame_highlights;
+
   int    row_offset;
   int    column_offset;
   
@@ -286,135 +876,1318 @@ typedef struct {
   int    rendered_x;
   
   int    row_count;
-  Row*   row;
+  Row*   root;
 
+  // Messages clear after MESSAGE_TIMEOUT seconds, unless they are a prompt
+  // that ask is waiting on.
   char   message[80];
   time_t message_time;
+  int    prompting;
 
   int dirty;
   int quit_times;
 
-  int last_match;
-  int direction;
+  // Counts edits to the rows, so that a save can tell whether what it wrote
+  // is still current.
+  int   edits;
+  Save* save;
 
-  int   saved_highlight_line;
-  char* saved_highlight;
+  // Every edit since the file was last saved is appended to a journal next
+  // to it, so the edits can be recovered after a crash. Records are written
+  // and synced in groups, every JOURNAL_COMMIT milliseconds at most.
+  int             journal;
+  Buffer          journal_pending;
+  long            journal_size;
+  struct timespec journal_committed;
+  int             journal_paused;
+  int             journal_found;
+
+  History history;
+
+  // Every match of the query being searched for, and the one the cursor is
+  // on. They are in order starting from match_origin and wrapping around.
+  // match_rows is how many rows had been indexed when the search started.
+  Matches matches;
+  char*   match_query;
+  int     match_index;
+  int     match_origin;
+  int     match_rows;
+  int     match_complete;
+  Search* search;
+
+  // Worker threads write to this pipe to wake up the editor.
+  int     wake[2];
 
   Syntax* syntax;
+  int     generation;
+
+  // Rows whose open_comment may be out of date. They are caught up in order,
+  // as far as the screen needs on every refresh and the rest when idle.
+  int     stale_start;
+  int     stale_end;
+
+  // Stands in for the user when keys are replayed from a script.
+  Replay* replay;
 } Editor;
 
-static void set_message(Editor* editor, const char* format, ...) {
-  va_list arguments;
-  va_start(arguments, format);
-  vsnprintf(editor->message, sizeof(editor->message), format, arguments);
-  va_end(arguments);
-  
-  editor->message_time = time(NULL);
+static unsigned next_priority() {
+  static unsigned state = 2463534242;
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
 }
 
-static void refresh_screen(Editor* editor);
+static int count_rows(Row* row) {
+  return row == NULL ? 0 : row->count;
+}
 
-static char* ask(Editor* editor, char* prompt, void(*callback)(Editor*, char*, int)) {
-  int   buffer_capacity = 128;
-  int   buffer_size     = 0;
-  char* buffer          = malloc(buffer_capacity);
-  buffer[0]             = 0;
-  
-  while (1) {
-    set_message(editor, prompt, buffer);
-    refresh_screen(editor);
+static void update_row(Row* row) {
+  row->count = count_rows(row->left) + 1 + count_rows(row->right);
+}
 
-    int c = read_key();
-    if (c == DELETE_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
-      if (buffer_size > 0) {
-	buffer_size--;
-	buffer[buffer_size] = 0;
-      }
-    }
+// Rows, their text, rendered text and highlights come out of a pool rather
+// than straight from malloc, since a big file has millions of them. Blocks
+// are carved out of big chunks in power-of-two size classes, plus a class
+// sized for rows, and freed blocks go on a list for their class to be handed
+// out again. A block grows in place while the new size still fits its class.
+// Blocks too big for any class come from malloc. Only the main thread uses
+// the pool; workers just read rows.
+typedef struct Block Block;
 
-    else if (c == 0x1B) {
-      set_message(editor, "");
-      if (callback != NULL) {
-	callback(editor, buffer, c);
-      }
-      free(buffer);
-      return NULL;
-    }
-    
-    else if (c == '\r') {
-      set_message(editor, "");
-      if (callback != NULL) {
-	callback(editor, buffer, c);
-      }
-      return buffer;
-    }
+struct Block {
+  Block* next;
+};
 
-    else if (!iscntrl(c) && c < 128) {
-      if (buffer_size == buffer_capacity - 1) {
-	buffer_capacity *= 2;
-	buffer           = realloc(buffer, buffer_capacity);
-      }
-      buffer[buffer_size] = c;
-      buffer_size++;
-      buffer[buffer_size] = 0;
-    }
+typedef struct {
+  Block* free[POOL_CLASSES + 1];
+  char*  chunk;
+  int    chunk_left;
+  long   used;
+  long   reserved;
+} Pool;
 
-    if (callback != NULL) {
-      callback(editor, buffer, c);
-    }
+static Pool pool;
+
+static int pool_class(int size) {
+  int class = 0;
+  while (class < POOL_CLASSES && POOL_BLOCK << class < size) {
+    class++;
   }
+  return class;
 }
 
-static int is_seperator(int c) {
-  return isspace(c) || c == 0 || strchr(",.()+-/*=~%<>[];", c) != NULL;
+static void* take_block(int class, int size) {
+  Block* block = pool.free[class];
+  if (block != NULL) {
+    pool.free[class] = block->next;
+  } else {
+    if (pool.chunk_left < size) {
+      pool.chunk       = malloc(POOL_CHUNK);
+      pool.chunk_left  = POOL_CHUNK;
+      pool.reserved   += POOL_CHUNK;
+    }
+    block            = (Block*) pool.chunk;
+    pool.chunk      += size;
+    pool.chunk_left -= size;
+  }
+  pool.used += size;
+  return block;
 }
 
-static void highlight_row(Editor* editor, Row* row) {
-  if (row->rendered_size > 0) {
-    if (row->highlights == NULL) {
-      row->highlights = malloc(row->rendered_size);
-    } else {
-      row->highlights = realloc(row->highlights, row->rendered_size);
-    }
+static void give_block(int class, int size, void* block) {
+  ((Block*) block)->next = pool.free[class];
+  pool.free[class]       = block;
+  pool.used             -= size;
+}
 
-    memset(row->highlights, HIGHLIGHT_NORMAL, row->rendered_size);
+// Frees a block given the capacity pool_resize left for it. Any capacity
+// over half of it will do for blocks in a class.
+static void pool_free(void* block, int capacity) {
+  if (block == NULL) {
+    return;
+  }
+  int class = pool_class(capacity);
+  if (class < POOL_CLASSES) {
+    give_block(class, POOL_BLOCK << class, block);
+  } else {
+    free(block);
+    pool.used     -= capacity;
+    pool.reserved -= capacity;
   }
+}
 
-  if (editor->syntax == NULL) {
-    return;
+// Returns a block of at least `size` bytes in place of `block`, whose
+// capacity is updated, keeping its contents. A NULL block with a capacity of
+// 0 gets a new one.
+static void* pool_resize(void* block, int* capacity, int size) {
+  if (block != NULL && size <= *capacity) {
+    return block;
+  }
+  int   class  = pool_class(size);
+  void* result = NULL;
+  if (class < POOL_CLASSES) {
+    result = take_block(class, POOL_BLOCK << class);
+    if (block != NULL) {
+      memcpy(result, block, *capacity);
+      pool_free(block, *capacity);
+    }
+    *capacity = POOL_BLOCK << class;
+    return result;
+  }
+  if (block != NULL && pool_class(*capacity) == POOL_CLASSES) {
+    result         = realloc(block, size);
+    pool.used     += size - *capacity;
+    pool.reserved += size - *capacity;
+  } else {
+    result = malloc(size);
+    if (block != NULL) {
+      memcpy(result, block, *capacity);
+      pool_free(block, *capacity);
+    }
+    pool.used     += size;
+    pool.reserved += size;
   }
+  *capacity = size;
+  return result;
+}
 
-  Syntax* syntax                    = editor->syntax;
-  char*   single_comment_start      = syntax->single_line_comment_start;
-  int     single_comment_start_size = strlen(single_comment_start);
-  char*   multi_comment_start       = syntax->multi_line_comment_start;
-  int     multi_comment_start_size  = strlen(multi_comment_start);
-  char*   multi_comment_end         = syntax->multi_line_comment_end;
-  int     multi_comment_end_size    = strlen(multi_comment_end);
-  char**  keywords                  = syntax->keywords;
+static Row* alloc_row() {
+  Row* row = take_block(POOL_CLASSES, sizeof(Row));
+  memset(row, 0, sizeof(Row));
+  return row;
+}
 
-  int previous_seperator = 1;
-  int in_string          = 0;
-  int in_comment         = row->index > 0 && editor->row[row->index - 1].open_comment;
-  int index              = 0;
-  while (index < row->rendered_size) {
-    char c                  = row->rendered[index];
-    int  previous_highlight = index == 0 ? HIGHLIGHT_NORMAL : row->highlights[index - 1];
+static void free_chunk(Chunk* chunk) {
+  pool_free(chunk->checkpoints, chunk->checkpoints_capacity);
+  pool_free(chunk->rendered, chunk->rendered_capacity);
+  pool_free(chunk->highlights.data, sizeof(Span) * chunk->highlights.capacity);
+}
 
-    if (single_comment_start_size > 0 && !in_string && !in_comment) {
-      if (!strncmp(&row->rendered[index], single_comment_start, single_comment_start_size)) {
-	memset(&row->highlights[index], HIGHLIGHT_COMMENT, row->rendered_size - index);
-	break;
+static void free_chunks(Row* row) {
+  Chunks* chunks = row->chunks;
+  if (chunks != NULL) {
+    for (int i = 0; i <= chunks->size; i++) {
+      free_chunk(&chunks->data[i]);
+    }
+    free(chunks->data);
+    free(chunks);
+    row->chunks = NULL;
+  }
+}
 
+static void free_row(Row* row) {
+  if (!row->mapped) {
+    pool_free(row->data, row->capacity);
+  }
+  if (!row->plain) {
+    pool_free(row->rendered, row->rendered_capacity);
+  }
+  pool_free(row->highlights.data, sizeof(Span) * row->highlights.capacity);
+  free_chunks(row);
+  give_block(POOL_CLASSES, sizeof(Row), row);
+}
 
+static void retain_rows(Row* row) {
+  if (row != NULL) {
+    row->references++;
+  }
+}
 
-      }
+static void release_rows(Row* row) {
+  if (row != NULL) {
+    row->references--;
+    if (row->references == 0) {
+      release_rows(row->left);
+      release_rows(row->right);
+      free_row(row);
     }
+  }
+}
 
-    if (multi_comment_start_size > 0 && multi_comment_end_size > 0 && !in_string) {
-      if (in_comment) {
-	if (!strncmp(&row->rendered[index], multi_comment_end, multi_comment_end_size)) {
-	  memset(&row->highlights[index], HIGHLIGHT_COMMENTS, multi_comment_end_size);
+// Takes over a reference to a row and returns a node that may be changed in
+// place, which is a copy if the row was shared. Cached rendering isn't
+// copied over.
+static Row* own_row(Row* row) {
+  if (row->references == 1) {
+    return row;
+  }
+
+  Row* copy               = alloc_row();
+  *copy                   = *row;
+  copy->references        = 1;
+  copy->stamp             = 0;
+  copy->plain             = 0;
+  copy->rendered          = NULL;
+  copy->rendered_capacity = 0;
+  memset(&copy->highlights, 0, sizeof(Spans));
+  copy->chunks            = NULL;
+  if (!row->mapped) {
+    copy->capacity = 0;
+    copy->data     = pool_resize(NULL, &copy->capacity, row->size + 1);
+    memcpy(copy->data, row->data, row->size + 1);
+  }
+  retain_rows(copy->left);
+  retain_rows(copy->right);
+  row->references--;
+  return copy;
+}
+
+static Row* merge_rows(Row* left, Row* right) {
+  if (left == NULL) {
+    return right;
+  }
+  if (right == NULL) {
+    return left;
+  }
+  if (left->priority > right->priority) {
+    left        = own_row(left);
+    left->right = merge_rows(left->right, right);
+    update_row(left);
+    return left;
+  } else {
+    right       = own_row(right);
+    right->left = merge_rows(left, right->left);
+    update_row(right);
+    return right;
+  }
+}
+
+// Splits the tree into its first `at` rows and the rest.
+static void split_rows(Row* row, int at, Row** left, Row** right) {
+  if (row == NULL) {
+    *left  = NULL;
+    *right = NULL;
+    return;
+  }
+  row            = own_row(row);
+  int left_count = count_rows(row->left);
+  if (at <= left_count) {
+    split_rows(row->left, at, left, &row->left);
+    *right = row;
+  } else {
+    split_rows(row->right, at - left_count - 1, &row->right, right);
+    *left = row;
+  }
+  update_row(row);
+}
+
+static int recount_rows(Row* row) {
+  if (row == NULL) {
+    return 0;
+  }
+  row->count = recount_rows(row->left) + 1 + recount_rows(row->right);
+  return row->count;
+}
+
+// Builds a treap out of rows that are already in order in linear time, by
+// keeping the right spine of the tree on a stack.
+static Row* build_rows(Row** rows, int count) {
+  Row** stack = malloc(sizeof(Row*) * count);
+  int   size  = 0;
+  for (int i = 0; i < count; i++) {
+    Row* row  = rows[i];
+    Row* last = NULL;
+    while (size > 0 && stack[size - 1]->priority < row->priority) {
+      size--;
+      last = stack[size];
+    }
+    row->left = last;
+    if (size > 0) {
+      stack[size - 1]->right = row;
+    }
+    stack[size] = row;
+    size++;
+  }
+  Row* root = count > 0 ? stack[0] : NULL;
+  recount_rows(root);
+  free(stack);
+  return root;
+}
+
+static Row* find_row(Row* row, int at) {
+  while (row != NULL) {
+    int left_count = count_rows(row->left);
+    if (at < left_count) {
+      row = row->left;
+    } else if (at == left_count) {
+      break;
+    } else {
+      at  -= left_count + 1;
+      row  = row->right;
+    }
+  }
+  return row;
+}
+
+static Row* get_row(Editor* editor, int at) {
+  return find_row(editor->root, at);
+}
+
+// Finds a row in order to change it, first making sure that neither it nor
+// any node above it is shared with a snapshot.
+static Row* edit_row(Editor* editor, int at) {
+  editor->edits++;
+  Row** link = &editor->root;
+  while (1) {
+    Row* row       = own_row(*link);
+    *link          = row;
+    int left_count = count_rows(row->left);
+    if (at < left_count) {
+      link = &row->left;
+    } else if (at == left_count) {
+      return row;
+    } else {
+      at   -= left_count + 1;
+      link  = &row->right;
+    }
+  }
+}
+
+static void set_message(Editor* editor, const char* format, ...) {
+  va_list arguments;
+  va_start(arguments, format);
+  vsnprintf(editor->message, sizeof(editor->message), format, arguments);
+  va_end(arguments);
+  
+  editor->message_time = time(NULL);
+}
+
+static double elapsed_milliseconds(struct timespec* start) {
+  struct timespec end = {};
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) * 1e3 + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void refresh_screen(Editor* editor);
+static void finish_save(Editor* editor, int wait);
+static void step_replay(Editor* editor);
+static void write_profile(Editor* editor);
+static void resize_editor(Editor* editor);
+
+static void index_editor(Editor* editor, size_t budget);
+
+// A journal starts with the version of its records and the size and
+// modification time of the file its edits apply to. Each record after that
+// is an operation, two numbers and some text, all numbers being
+// variable-length. The version goes up whenever what a record means
+// changes, and journals of other versions aren't recovered.
+typedef struct {
+  char magic[8];
+  long version;
+  long size;
+  long modified;
+  long modified_nsec;
+} JournalHeader;
+
+static void journal_name(Editor* editor, char* name) {
+  snprintf(name, PATH_MAX, "%s.journal", editor->file_name);
+}
+
+static void journal_header(Editor* editor, JournalHeader* header) {
+  struct stat status = {};
+  stat(editor->file_name, &status);
+  memset(header, 0, sizeof(JournalHeader));
+  memcpy(header->magic, "EDITOR1J", 8);
+  header->version       = JOURNAL_VERSION;
+  header->size          = status.st_size;
+  header->modified      = status.st_mtim.tv_sec;
+  header->modified_nsec = status.st_mtim.tv_nsec;
+}
+
+static void stop_journal(Editor* editor, int remove) {
+  if (editor->journal != -1) {
+    close(editor->journal);
+    editor->journal = -1;
+  }
+  if (remove && editor->file_name != NULL) {
+    char name[PATH_MAX];
+    journal_name(editor, name);
+    unlink(name);
+  }
+  editor->journal_pending.size = 0;
+  editor->journal_size         = 0;
+}
+
+static int start_journal(Editor* editor) {
+  char name[PATH_MAX];
+  journal_name(editor, name);
+  editor->journal = open(name, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0600);
+  if (editor->journal == -1) {
+    return 0;
+  }
+  JournalHeader header = {};
+  journal_header(editor, &header);
+  buffer_append(&editor->journal_pending, (char*) &header, sizeof(header));
+  editor->journal_size = sizeof(header);
+  clock_gettime(CLOCK_MONOTONIC, &editor->journal_committed);
+  return 1;
+}
+
+// Writes out and syncs every record since the last commit at once.
+static void commit_journal(Editor* editor) {
+  Buffer* pending = &editor->journal_pending;
+  if (editor->journal != -1 && pending->size > 0) {
+    int written = 0;
+    while (written < pending->size) {
+      int result = write(editor->journal, &pending->data[written], pending->size - written);
+      if (result == -1 && errno != EINTR) {
+	set_message(editor, "Journal failed, edits can't be recovered: %s", strerror(errno));
+	stop_journal(editor, 1);
+	editor->journal_paused = 1;
+	return;
+      }
+      written += result == -1 ? 0 : result;
+    }
+    fdatasync(editor->journal);
+  }
+  pending->size = 0;
+  clock_gettime(CLOCK_MONOTONIC, &editor->journal_committed);
+}
+
+static int journal_due(Editor* editor) {
+  return editor->journal_pending.size > 0;
+}
+
+static void journal_number(Buffer* buffer, unsigned long number) {
+  do {
+    char byte = number & 0x7F;
+    number  >>= 7;
+    if (number != 0) {
+      byte |= 0x80;
+    }
+    buffer_append(buffer, &byte, 1);
+  } while (number != 0);
+}
+
+// Adds an edit to the step the current key opened, or to the step before
+// if both only typed characters next to each other.
+static void remember_edit(History* history, Edit* edit, char* text) {
+  int redone = history->current < history->step_count;
+  if (redone) {
+    history->step_count = history->current;
+    history->log.size   = history->current > 0 ? history->steps[history->current - 1].end : 0;
+  }
+
+  Step* last    = history->current > 0 ? &history->steps[history->current - 1] : NULL;
+  int   typing  = edit->operation == EDIT_INSERT_CHAR;
+  int   follows =
+    last != NULL && !redone && last->typing && typing &&
+    last->after_y == edit->a && last->after_x == edit->b;
+  if (!history->open && !follows) {
+    if (history->step_count == history->step_capacity) {
+      history->step_capacity = history->step_capacity == 0 ? 64 : history->step_capacity * 2;
+      history->steps         = realloc(history->steps, sizeof(Step) * history->step_capacity);
+    }
+    Step* step     = &history->steps[history->step_count];
+    step->start    = history->log.size;
+    step->cursor_y = history->cursor_y;
+    step->cursor_x = history->cursor_x;
+    step->typing   = 1;
+    history->step_count++;
+    history->current = history->step_count;
+    last             = step;
+  }
+  history->open = 1;
+
+  buffer_append(&history->log, (char*) edit, sizeof(Edit));
+  buffer_append(&history->log, text, edit->text_size);
+  while (history->log.size % sizeof(int) != 0) {
+    buffer_append(&history->log, "", 1);
+  }
+  last->end     = history->log.size;
+  last->typing  = last->typing && typing;
+  last->after_y = edit->a;
+  last->after_x = edit->b + 1;
+}
+
+// Journals an edit and keeps it for undo, unless it's being replayed.
+static void record_edit(Editor* editor, int operation, int a, int b, char* text, int text_size) {
+  if (!editor->history.paused) {
+    Edit edit = { operation, a, b, text_size };
+    remember_edit(&editor->history, &edit, text);
+  }
+
+  if (editor->file_name == NULL || editor->journal_paused) {
+    return;
+  }
+  if (editor->journal == -1 && !start_journal(editor)) {
+    return;
+  }
+  Buffer* pending = &editor->journal_pending;
+  int     before  = pending->size;
+  journal_number(pending, operation);
+  journal_number(pending, a);
+  journal_number(pending, b);
+  journal_number(pending, text_size);
+  buffer_append(pending, text, text_size);
+  editor->journal_size += pending->size - before;
+}
+
+static void update_comments(Editor* editor, int limit, int budget);
+
+static int has_idle_work(Editor* editor) {
+  return editor->stale_start < editor->stale_end || editor->map_indexed < editor->map_size;
+}
+
+static void do_idle_work(Editor* editor) {
+  if (editor->stale_start < editor->stale_end) {
+    update_comments(editor, editor->row_count, COMMENT_SLICE);
+  } else {
+    index_editor(editor, INDEX_SLICE);
+  }
+}
+
+// Reads the next key, catching up on comment states and splitting more of
+// the file into rows a slice at a time while waiting for it. Returns
+// WAKE_KEY instead when a worker thread has something for the editor.
+static int next_key(Editor* editor) {
+  while (1) {
+    if (input_start < input_end) {
+      return read_key();
+    }
+    struct pollfd inputs[] = {
+      { terminal_input,  POLLIN,                         0 },
+      { editor->wake[0], POLLIN,                         0 },
+      { terminal_output, frame_pending() ? POLLOUT : 0, 0 },
+    };
+    // With nothing to do, the editor only wakes up for input, workers,
+    // signals and the timers for the journal and the message bar.
+    int timeout = has_idle_work(editor) ? 0 : -1;
+    if (timeout == -1 && journal_due(editor)) {
+      double waited = elapsed_milliseconds(&editor->journal_committed);
+      timeout       = waited < JOURNAL_COMMIT ? JOURNAL_COMMIT - waited : 0;
+    }
+    if (timeout != 0 && editor->message[0] != 0 && !editor->prompting) {
+      long left = (editor->message_time + MESSAGE_TIMEOUT - time(NULL)) * 1000;
+      if (left < 0) {
+	left = 0;
+      }
+      if (timeout == -1 || left < timeout) {
+	timeout = left;
+      }
+    }
+    if (editor->replay != NULL && timeout != 0 && editor->search == NULL && editor->save == NULL) {
+      step_replay(editor);
+    }
+    if (poll(inputs, length(inputs), timeout) == -1 && errno != EINTR) {
+      die("poll");
+    }
+    if ((inputs[2].revents & (POLLOUT | POLLERR | POLLHUP)) && flush_frame() && editor->frame_owed) {
+      refresh_screen(editor);
+    }
+    if (inputs[0].revents & POLLIN) {
+      return read_key();
+    }
+    if (inputs[1].revents & POLLIN) {
+      char drain[64];
+      while (read(editor->wake[0], drain, sizeof(drain)) > 0) {
+      }
+      finish_save(editor, 0);
+      if (profile_requested) {
+	profile_requested = 0;
+	write_profile(editor);
+      }
+      if (window_resized) {
+	window_resized = 0;
+	resize_editor(editor);
+      }
+      return WAKE_KEY;
+    }
+    if (journal_due(editor) && elapsed_milliseconds(&editor->journal_committed) >= JOURNAL_COMMIT) {
+      commit_journal(editor);
+    }
+    if (editor->message[0] != 0 && !editor->prompting && time(NULL) - editor->message_time >= MESSAGE_TIMEOUT) {
+      editor->message[0] = 0;
+      refresh_screen(editor);
+    }
+    if (has_idle_work(editor)) {
+      do_idle_work(editor);
+      refresh_screen(editor);
+    }
+  }
+}
+
+static char* ask(Editor* editor, char* prompt, void(*callback)(Editor*, char*, int)) {
+  int   buffer_capacity = 128;
+  int   buffer_size     = 0;
+  char* buffer          = malloc(buffer_capacity);
+  buffer[0]             = 0;
+  set_message(editor, prompt, buffer);
+  editor->prompting = 1;
+  
+  while (1) {
+    if (!key_pending()) {
+      refresh_screen(editor);
+    }
+
+    int c = next_key(editor);
+    if (c == DELETE_KEY || c == CTRL_KEY('h') || c == BACKSPACE) {
+      if (buffer_size > 0) {
+	buffer_size--;
+	buffer[buffer_size] = 0;
+      }
+    }
+
+    else if (c == 0x1B) {
+      set_message(editor, "");
+      editor->prompting = 0;
+      if (callback != NULL) {
+	callback(editor, buffer, c);
+      }
+      free(buffer);
+      return NULL;
+    }
+    
+    else if (c == '\r') {
+      set_message(editor, "");
+      editor->prompting = 0;
+      if (callback != NULL) {
+	callback(editor, buffer, c);
+      }
+      return buffer;
+    }
+
+    else if (c == PASTE_KEY || (c < 128 && !iscntrl(c))) {
+      char  key       = c;
+      char* text      = &key;
+      int   text_size = 1;
+      if (c == PASTE_KEY) {
+	read_paste(&editor->paste);
+	text      = editor->paste.data;
+	text_size = editor->paste.size;
+      }
+      for (int i = 0; i < text_size; i++) {
+	if (iscntrl(text[i]) || (unsigned char) text[i] >= 128) {
+	  continue;
+	}
+	if (buffer_size == buffer_capacity - 1) {
+	  buffer_capacity *= 2;
+	  buffer           = realloc(buffer, buffer_capacity);
+	}
+	buffer[buffer_size] = text[i];
+	buffer_size++;
+      }
+      buffer[buffer_size] = 0;
+    }
+
+    set_message(editor, prompt, buffer);
+    if (callback != NULL) {
+      callback(editor, buffer, c);
+    }
+  }
+}
+
+static int is_seperator(int c) {
+  return isspace(c) || c == 0 || strchr(",.()+-/*=~%<>[];", c) != NULL;
+}
+
+static char seperators[256];
+
+static void syntax_error(char* file_name, int line_number, char* message) {
+  fprintf(stderr, "%s:%d: %s\n", file_name, line_number, message);
+  exit(EXIT_FAILURE);
+}
+
+static char** append_word(char** words, int* size, char* word) {
+  words        = realloc(words, sizeof(char*) * (*size + 2));
+  words[*size] = word;
+  (*size)++;
+  words[*size] = NULL;
+  return words;
+}
+
+// Reads a syntax from lines of a word and its values, split on spaces:
+//
+//   syntax NAME
+//   files .EXTENSION...
+//   comment START
+//   comments START END
+//   highlight numbers strings
+//   keywords WORD...
+//   keywords2 WORD...
+//
+// Keywords are tried in the order they are listed, and the first one that
+// fits wins. Lines starting with # are skipped. A keyword trie node is found
+// by a short index and a keyword by a shorter one, so a syntax can't have
+// more keyword bytes or keywords than those can count.
+static void read_syntax(FILE* file, char* file_name) {
+  Syntax syntax = {
+    .file_match                = calloc(1, sizeof(char*)),
+    .keywords                  = calloc(1, sizeof(char*)),
+    .single_line_comment_start = "",
+    .multi_line_comment_start  = "",
+    .multi_line_comment_end    = "",
+  };
+  int    files_size    = 0;
+  int    keywords_size = 0;
+  int    keyword_bytes = 0;
+  char*  line          = NULL;
+  size_t line_capacity = 0;
+  int    line_number   = 0;
+
+  while (getline(&line, &line_capacity, file) != -1) {
+    line_number++;
+    char* word = strtok(line, " \t\r\n");
+    if (word == NULL || word[0] == '#') {
+      continue;
+    }
+
+    char** values      = calloc(1, sizeof(char*));
+    int    value_count = 0;
+    char*  value       = NULL;
+    while ((value = strtok(NULL, " \t\r\n")) != NULL) {
+      if (strlen(value) > KEYWORD_LIMIT) {
+	syntax_error(file_name, line_number, "too long");
+      }
+      values = append_word(values, &value_count, strdup(value));
+    }
+
+    if (strcmp(word, "syntax") == 0 && value_count == 1) {
+      syntax.file_type = values[0];
+    } else if (strcmp(word, "files") == 0) {
+      for (int i = 0; i < value_count; i++) {
+	syntax.file_match = append_word(syntax.file_match, &files_size, values[i]);
+      }
+    } else if (strcmp(word, "comment") == 0 && value_count == 1) {
+      syntax.single_line_comment_start = values[0];
+    } else if (strcmp(word, "comments") == 0 && value_count == 2) {
+      syntax.multi_line_comment_start = values[0];
+      syntax.multi_line_comment_end   = values[1];
+    } else if (strcmp(word, "highlight") == 0) {
+      for (int i = 0; i < value_count; i++) {
+	if (strcmp(values[i], "numbers") == 0) {
+	  syntax.flags |= HIGHLIGHT_NUMBERS;
+	} else if (strcmp(values[i], "strings") == 0) {
+	  syntax.flags |= HIGHLIGHT_STRINGS;
+	} else {
+	  syntax_error(file_name, line_number, "unknown highlight");
+	}
+	free(values[i]);
+      }
+    } else if (strcmp(word, "keywords") == 0 || strcmp(word, "keywords2") == 0) {
+      for (int i = 0; i < value_count; i++) {
+	char* keyword  = values[i];
+	keyword_bytes += strlen(keyword);
+	if (strcmp(word, "keywords2") == 0) {
+	  keyword = realloc(keyword, strlen(keyword) + 2);
+	  strcat(keyword, "|");
+	}
+	syntax.keywords = append_word(syntax.keywords, &keywords_size, keyword);
+      }
+      if (keyword_bytes >= USHRT_MAX || keywords_size > SHRT_MAX) {
+	syntax_error(file_name, line_number, "too many keywords");
+      }
+    } else {
+      syntax_error(file_name, line_number, "unknown line");
+    }
+    free(values);
+  }
+  free(line);
+
+  if (syntax.file_type == NULL) {
+    syntax_error(file_name, line_number, "no syntax name");
+  }
+  syntaxes               = realloc(syntaxes, sizeof(Syntax) * (syntax_count + 1));
+  syntaxes[syntax_count] = syntax;
+  syntax_count++;
+}
+
+static void load_syntaxes() {
+  char  directory[PATH_MAX];
+  char* path = getenv("EDITOR1_SYNTAX");
+  char* home = getenv("HOME");
+  if (path == NULL && home != NULL) {
+    snprintf(directory, sizeof(directory), "%s/.editor1/syntax", home);
+    path = directory;
+  }
+
+  struct dirent** entries = NULL;
+  int             count   = path == NULL ? -1 : scandir(path, &entries, NULL, alphasort);
+  for (int i = 0; i < count; i++) {
+    char* name = entries[i]->d_name;
+    int   size = strlen(name);
+    if (size > 7 && strcmp(&name[size - 7], ".syntax") == 0) {
+      char file_name[PATH_MAX + NAME_MAX + 2];
+      snprintf(file_name, sizeof(file_name), "%s/%s", path, name);
+      FILE* file = fopen(file_name, "r");
+      if (file == NULL) {
+	syntax_error(file_name, 0, strerror(errno));
+      }
+      read_syntax(file, file_name);
+      fclose(file);
+    }
+    free(entries[i]);
+  }
+  free(entries);
+
+  for (int i = 0; i < length(builtin_syntaxes); i++) {
+    FILE* file = fmemopen(builtin_syntaxes[i], strlen(builtin_syntaxes[i]), "r");
+    read_syntax(file, "built-in syntax");
+    fclose(file);
+  }
+}
+
+// Returns 1 if text starts with the marker, 0 if it doesn't, and -1 if the
+// text is too short to tell but more may follow.
+static int match_marker(char* marker, int marker_size, unsigned char* text, int size, int ended) {
+  int checked = size < marker_size ? size : marker_size;
+  if (marker_size == 0 || memcmp(text, marker, checked) != 0) {
+    return 0;
+  }
+  return checked == marker_size ? 1 : ended ? 0 : -1;
+}
+
+// Works out the token that the `size` bytes of text start with in a context,
+// the way lex_text does without a table. Unless `ended` says the text ends
+// there, this returns 0 when the token depends on bytes yet to come. below[]
+// holds the first keyword under each trie node.
+static int decide_token(Syntax* syntax, int* below, int context, unsigned char* text, int size, int ended, Token* token) {
+  int c = text[0];
+
+  if (context == CONTEXT_COMMENT) {
+    int found = match_marker(syntax->multi_line_comment_end, syntax->multi_line_comment_end_size, text, size, ended);
+    if (found == -1) {
+      return 0;
+    }
+    *token = found
+      ? (Token) { syntax->multi_line_comment_end_size, HIGHLIGHT_COMMENTS, CONTEXT_NORMAL + 1 }
+      : (Token) { 1, HIGHLIGHT_NORMAL, CONTEXT_COMMENT };
+    return 1;
+  }
+
+  if (context == CONTEXT_DOUBLE || context == CONTEXT_SINGLE) {
+    int quote = context == CONTEXT_DOUBLE ? '"' : '\'';
+    if (c == '\'' && size == 1 && !ended) {
+      return 0;
+    }
+    *token = c == '\'' && size > 1
+      ? (Token) { 2, HIGHLIGHT_STRING, context }
+      : (Token) { 1, HIGHLIGHT_STRING, c == quote ? CONTEXT_NORMAL : context };
+    return 1;
+  }
+
+  int previous_seperator = context & 1;
+  int previous_number    = context & 2;
+
+  int found = match_marker(syntax->single_line_comment_start, syntax->single_line_comment_start_size, text, size, ended);
+  if (found != 0) {
+    *token = (Token) { 0, HIGHLIGHT_COMMENT, CONTEXT_LINE };
+    return found == 1;
+  }
+
+  if (syntax->multi_line_comment_start_size > 0 && syntax->multi_line_comment_end_size > 0) {
+    found = match_marker(syntax->multi_line_comment_start, syntax->multi_line_comment_start_size, text, size, ended);
+    if (found != 0) {
+      *token = (Token) { syntax->multi_line_comment_start_size, HIGHLIGHT_COMMENTS, CONTEXT_COMMENT };
+      return found == 1;
+    }
+  }
+
+  if ((syntax->flags & HIGHLIGHT_STRINGS) && (c == '"' || c == '\'')) {
+    *token = (Token) { 1, HIGHLIGHT_STRING, c == '"' ? CONTEXT_DOUBLE : CONTEXT_SINGLE };
+    return 1;
+  }
+
+  if (syntax->flags & HIGHLIGHT_NUMBERS) {
+    if ((isdigit(c) && (previous_seperator || previous_number)) || (c == '.' && previous_number)) {
+      *token = (Token) { 1, HIGHLIGHT_NUMBER, CONTEXT_NORMAL + 2 };
+      return 1;
+    }
+  }
+
+  if (previous_seperator) {
+    KeywordNode* nodes   = syntax->keyword_nodes;
+    int          node    = 0;
+    int          keyword = INT_MAX;
+    int          depth   = 0;
+    for (; depth < size; depth++) {
+      node = nodes[node].next[text[depth]];
+      if (node == 0) {
+	break;
+      }
+      int candidate = nodes[node].keyword;
+      if (candidate != -1 && candidate < keyword) {
+	if (depth + 1 < size ? seperators[text[depth + 1]] : ended) {
+	  keyword = candidate;
+	  *token  = (Token) { depth + 1, nodes[node].highlight, CONTEXT_NORMAL };
+	}
+      }
+    }
+
+    // Every byte so far is on a keyword's path, so a longer text could still
+    // end an earlier keyword.
+    if (depth == size && !ended) {
+      int pending = nodes[node].keyword;
+      if ((pending != -1 && pending < keyword) || below[node] < keyword) {
+	return 0;
+      }
+    }
+    if (keyword != INT_MAX) {
+      return 1;
+    }
+  }
+
+  *token = (Token) { 1, HIGHLIGHT_NORMAL, CONTEXT_NORMAL + seperators[c] };
+  return 1;
+}
+
+static int add_token(LexTable* table, Token token) {
+  for (int i = 0; i < table->token_count; i++) {
+    Token other = table->tokens[i];
+    if (other.size == token.size && other.highlight == token.highlight && other.context == token.context) {
+      return i;
+    }
+  }
+  table->tokens                     = realloc(table->tokens, sizeof(Token) * (table->token_count + 1));
+  table->tokens[table->token_count] = token;
+  return table->token_count++;
+}
+
+static int build_entry(Syntax* syntax, LexTable* table, int* below, unsigned char* representatives,
+		       int context, unsigned char* prefix, int size);
+
+// Fills in a state's entries for each class of byte that can follow the
+// `size` bytes in prefix.
+static void fill_state(Syntax* syntax, LexTable* table, int* below, unsigned char* representatives,
+		       int state, int context, unsigned char* prefix, int size) {
+  assert(size < KEYWORD_LIMIT + 2);
+  for (int i = 0; i < table->class_count; i++) {
+    prefix[size] = representatives[i];
+    int entry    = build_entry(syntax, table, below, representatives, context, prefix, size + 1);
+    table->next[state * table->class_count + i] = entry;
+  }
+}
+
+static int add_state(LexTable* table) {
+  if (table->state_count == table->state_capacity) {
+    table->state_capacity = table->state_capacity == 0 ? 64 : table->state_capacity * 2;
+    table->next           = realloc(table->next, sizeof(int) * table->class_count * table->state_capacity);
+    table->ends           = realloc(table->ends, sizeof(int) * table->state_capacity);
+  }
+  return table->state_count++;
+}
+
+// Returns the entry for text starting with the `size` bytes in prefix: the
+// complement of its token if that is decided, or else a new state. A token
+// that isn't drawn and needs no bytes after its own goes straight on to the
+// start state of the next context instead.
+static int build_entry(Syntax* syntax, LexTable* table, int* below, unsigned char* representatives,
+		       int context, unsigned char* prefix, int size) {
+  Token token = {};
+  if (decide_token(syntax, below, context, prefix, size, 0, &token)) {
+    if (token.size == size && token.highlight == HIGHLIGHT_NORMAL && token.context != CONTEXT_LINE) {
+      return token.context;
+    }
+    return ~add_token(table, token);
+  }
+
+  int state = add_state(table);
+  decide_token(syntax, below, context, prefix, size, 1, &token);
+  table->ends[state] = ~add_token(table, token);
+  fill_state(syntax, table, below, representatives, state, context, prefix, size);
+  return state;
+}
+
+// Compiles a syntax, whose keyword trie has `node_count` nodes, into a state
+// table that lexes the same way lex_text does without one.
+static LexTable* compile_table(Syntax* syntax, int node_count) {
+  LexTable* table = calloc(1, sizeof(LexTable));
+
+  // Bytes in keywords and markers, and the ones lex_text looks for, can't
+  // share a class. The rest only differ in being seperators or digits.
+  int special[256] = {};
+  for (int i = 0; syntax->keywords[i] != NULL; i++) {
+    for (char* c = syntax->keywords[i]; *c != 0; c++) {
+      special[(unsigned char) *c] = 1;
+    }
+  }
+  char* markers[] = { syntax->single_line_comment_start, syntax->multi_line_comment_start, syntax->multi_line_comment_end, "\"'." };
+  for (int i = 0; i < length(markers); i++) {
+    for (char* c = markers[i]; *c != 0; c++) {
+      special[(unsigned char) *c] = 1;
+    }
+  }
+
+  int           signatures[256];
+  unsigned char representatives[256];
+  for (int c = 0; c < 256; c++) {
+    int signature = special[c] ? 4 + c : seperators[c] + 2 * (isdigit(c) != 0);
+    int class     = 0;
+    while (class < table->class_count && signatures[class] != signature) {
+      class++;
+    }
+    if (class == table->class_count) {
+      signatures[class]      = signature;
+      representatives[class] = c;
+      table->class_count++;
+    }
+    table->classes[c] = class;
+  }
+
+  // Nodes come after their parents, so going backwards finishes the
+  // children of a node before the node itself.
+  int* below = malloc(sizeof(int) * node_count);
+  for (int i = node_count - 1; i >= 0; i--) {
+    below[i] = INT_MAX;
+    for (int c = 0; c < 256; c++) {
+      int child = syntax->keyword_nodes[i].next[c];
+      if (child != 0) {
+	int keyword = syntax->keyword_nodes[child].keyword;
+	if (keyword != -1 && keyword < below[i]) {
+	  below[i] = keyword;
+	}
+	if (below[child] < below[i]) {
+	  below[i] = below[child];
+	}
+      }
+    }
+  }
+
+  // Start states are never at the end of the text, since lexing stops there.
+  for (int context = 0; context < CONTEXT_LINE; context++) {
+    int state          = add_state(table);
+    table->ends[state] = -1;
+  }
+  unsigned char prefix[KEYWORD_LIMIT + 2];
+  for (int context = 0; context < CONTEXT_LINE; context++) {
+    fill_state(syntax, table, below, representatives, context, context, prefix, 0);
+  }
+  free(below);
+  return table;
+}
+
+static void compile_syntax(Syntax* syntax) {
+  int          nodes_capacity = 16;
+  int          nodes_size     = 1;
+  KeywordNode* nodes          = calloc(nodes_capacity, sizeof(KeywordNode));
+  nodes[0].keyword            = -1;
+
+  for (int i = 0; syntax->keywords[i] != NULL; i++) {
+    char* keyword      = syntax->keywords[i];
+    int   keyword_size = strlen(keyword);
+    int   is_keyword2  = keyword[keyword_size - 1] == '|';
+    if (is_keyword2) {
+      keyword_size--;
+    }
+
+    int node = 0;
+    for (int j = 0; j < keyword_size; j++) {
+      unsigned char c = keyword[j];
+      if (nodes[node].next[c] == 0) {
+	if (nodes_size == nodes_capacity) {
+	  nodes_capacity *= 2;
+	  nodes           = realloc(nodes, sizeof(KeywordNode) * nodes_capacity);
+	}
+	memset(&nodes[nodes_size], 0, sizeof(KeywordNode));
+	nodes[nodes_size].keyword = -1;
+	nodes[node].next[c]       = nodes_size;
+	nodes_size++;
+      }
+      node = nodes[node].next[c];
+    }
+    if (nodes[node].keyword == -1) {
+      nodes[node].keyword   = i;
+      nodes[node].highlight = is_keyword2 ? HIGHLIGHT_KEYWORD2 : HIGHLIGHT_KEYWORD1;
+    }
+  }
+
+  syntax->keyword_nodes                  = nodes;
+  syntax->single_line_comment_start_size = strlen(syntax->single_line_comment_start);
+  syntax->multi_line_comment_start_size  = strlen(syntax->multi_line_comment_start);
+  syntax->multi_line_comment_end_size    = strlen(syntax->multi_line_comment_end);
+  syntax->table                          = compile_table(syntax, nodes_size);
+}
+
+static void compile_syntaxes() {
+  for (int c = 0; c < 256; c++) {
+    seperators[c] = is_seperator(c);
+  }
+  load_syntaxes();
+  for (int i = 0; i < syntax_count; i++) {
+    compile_syntax(&syntaxes[i]);
+  }
+}
+
+// Finds the keyword that starts text and is followed by a seperator, going
+// through the keyword list one entry at a time. This is what the trie is
+// measured against with --bench-highlight.
+static int match_keyword_list(Syntax* syntax, char* text, int size, int* highlight) {
+  char** keywords = syntax->keywords;
+  for (int i = 0; keywords[i] != NULL; i++) {
+    char* keyword      = keywords[i];
+    int   keyword_size = strlen(keywords[i]);
+    int   is_keyword2  = keyword[keyword_size - 1] == '|';
+    if (is_keyword2) {
+      keyword_size--;
+    }
+
+    if (keyword_size <= size && memcmp(text, keyword, keyword_size) == 0) {
+      if (keyword_size == size || seperators[(unsigned char)text[keyword_size]]) {
+	*highlight = is_keyword2 ? HIGHLIGHT_KEYWORD2 : HIGHLIGHT_KEYWORD1;
+	return keyword_size;
+      }
+    }
+  }
+  return 0;
+}
+
+// Does the same as match_keyword_list with one trie step per byte.
+static int match_keyword(Syntax* syntax, char* text, int size, int* highlight) {
+  KeywordNode* nodes   = syntax->keyword_nodes;
+  int          node    = 0;
+  int          keyword = -1;
+  int          result  = 0;
+  for (int i = 0; i < size; i++) {
+    node = nodes[node].next[(unsigned char)text[i]];
+    if (node == 0) {
+      break;
+    }
+    int candidate = nodes[node].keyword;
+    if (candidate != -1 && (keyword == -1 || candidate < keyword)) {
+      if (i + 1 == size || seperators[(unsigned char)text[i + 1]]) {
+	keyword    = candidate;
+	result     = i + 1;
+	*highlight = nodes[node].highlight;
+      }
+    }
+  }
+  return result;
+}
+
+static void mark(Spans* spans, int at, int size, int highlight) {
+  if (spans == NULL || size <= 0 || highlight == HIGHLIGHT_NORMAL) {
+    return;
+  }
+  if (spans->size > 0) {
+    Span* last = &spans->data[spans->size - 1];
+    if (last->highlight == highlight && last->start + last->size == at) {
+      last->size += size;
+      return;
+    }
+  }
+  if (spans->size == spans->capacity) {
+    int capacity    = sizeof(Span) * spans->capacity;
+    spans->data     = pool_resize(spans->data, &capacity, sizeof(Span) * (spans->capacity == 0 ? 8 : spans->capacity * 2));
+    spans->capacity = capacity / sizeof(Span);
+  }
+  spans->data[spans->size] = (Span) { at, size, highlight };
+  spans->size++;
+}
+
+static int starts_with(char* text, int size, char* prefix, int prefix_size) {
+  return prefix_size <= size && memcmp(text, prefix, prefix_size) == 0;
+}
+
+// Does what lex_text does with a syntax's state table, one step per byte.
+// Tokens that turn out shorter than the bytes looked at, like a word that
+// only starts like a keyword, step over those bytes again.
+static void lex_table(LexTable* table, char* text, int size, int start, int end, Lexer* lexer, Spans* highlights) {
+  unsigned char* bytes   = (unsigned char*) text;
+  int            context = lexer->in_comment ? CONTEXT_COMMENT
+			 : lexer->in_string == '"' ? CONTEXT_DOUBLE
+			 : lexer->in_string != 0 ? CONTEXT_SINGLE
+			 : CONTEXT_NORMAL + lexer->previous_seperator + 2 * lexer->in_number;
+  int            token   = lexer->skip_highlight;
+  int            index   = start + lexer->skip;
+  mark(highlights, start, (index < end ? index : end) - start, token);
+
+  unsigned char* classes     = table->classes;
+  int            class_count = table->class_count;
+  int*           next        = table->next;
+  int            state       = context;
+  int            at          = index;
+  while (1) {
+    if (state < CONTEXT_LINE) {
+      index   = at;
+      context = state;
+      if (at >= end) {
+	break;
+      }
+    }
+    state = at < size ? next[state * class_count + classes[bytes[at]]] : table->ends[state];
+    at++;
+    if (state >= 0) {
+      continue;
+    }
+
+    Token found = table->tokens[~state];
+    if (found.context == CONTEXT_LINE) {
+      mark(highlights, index, end - index, HIGHLIGHT_COMMENT);
+      lexer->line_comment = 1;
+      index   = end;
+      context = CONTEXT_NORMAL + (context & 1);
+      break;
+    }
+    if (found.highlight != HIGHLIGHT_NORMAL) {
+      mark(highlights, index, found.size, found.highlight);
+    }
+    token = found.highlight;
+    at    = index + found.size;
+    state = found.context;
+  }
+
+  // Inside comments and strings, whether a seperator came last doesn't
+  // matter, and is left unset.
+  lexer->previous_seperator = context < CONTEXT_COMMENT && (context & 1);
+  lexer->in_number          = context < CONTEXT_COMMENT && (context & 2);
+  lexer->in_comment         = context == CONTEXT_COMMENT;
+  lexer->in_string          = context == CONTEXT_DOUBLE ? '"' : context == CONTEXT_SINGLE ? '\'' : 0;
+  lexer->skip               = index - end;
+  lexer->skip_highlight     = lexer->skip > 0 ? token : HIGHLIGHT_NORMAL;
+}
+
+// Lexes text from `start` up to `end`, picking up from and leaving the state
+// in `lexer`, so that long rows can be highlighted a chunk at a time. Tokens
+// are matched against all `size` bytes and may run past `end`, in which case
+// the next chunk starts with them as its `skip` bytes. Without highlights,
+// this only works out the state.
+static void lex_text(Syntax* syntax, char* text, int size, int start, int end, Lexer* lexer, Spans* highlights) {
+  char*   single_comment_start      = syntax->single_line_comment_start;
+  int     single_comment_start_size = syntax->single_line_comment_start_size;
+  char*   multi_comment_start       = syntax->multi_line_comment_start;
+  int     multi_comment_start_size  = syntax->multi_line_comment_start_size;
+  char*   multi_comment_end         = syntax->multi_line_comment_end;
+  int     multi_comment_end_size    = syntax->multi_line_comment_end_size;
+
+  if (lexer->line_comment) {
+    mark(highlights, start, end - start, HIGHLIGHT_COMMENT);
+    return;
+  }
+
+  if (syntax->table != NULL) {
+    lex_table(syntax->table, text, size, start, end, lexer, highlights);
+    return;
+  }
+
+  int previous_seperator = lexer->previous_seperator;
+  int in_comment         = lexer->in_comment;
+  int in_string          = lexer->in_string;
+  int in_number          = lexer->in_number;
+  int token              = lexer->skip_highlight;
+  int index              = start + lexer->skip;
+  mark(highlights, start, (index < end ? index : end) - start, token);
+
+  while (index < end) {
+    char c               = text[index];
+    int  left            = size - index;
+    int  previous_number = in_number;
+    in_number            = 0;
+
+    if (single_comment_start_size > 0 && !in_string && !in_comment) {
+      if (starts_with(&text[index], left, single_comment_start, single_comment_start_size)) {
+	mark(highlights, index, end - index, HIGHLIGHT_COMMENT);
+	lexer->line_comment = 1;
+	index = end;
+	break;
+      }
+    }
+
+    if (multi_comment_start_size > 0 && multi_comment_end_size > 0 && !in_string) {
+      if (in_comment) {
+	if (starts_with(&text[index], left, multi_comment_end, multi_comment_end_size)) {
+	  mark(highlights, index, multi_comment_end_size, HIGHLIGHT_COMMENTS);
+	  token = HIGHLIGHT_COMMENTS;
 	  index += multi_comment_end_size;
 	  in_comment = 0;
 	  previous_seperator = 1;
@@ -423,8 +2196,9 @@ static void highlight_row(Editor* editor, Row* row) {
 	  index++;
 	  continue;
 	}
-      } else if (!strncmp(&row->rendered[index], multi_comment_start, multi_comment_start_size)) {
-	memset(&row->highlights[index], HIGHLIGHT_COMMENTS, multi_comment_start_size);
+      } else if (starts_with(&text[index], left, multi_comment_start, multi_comment_start_size)) {
+	mark(highlights, index, multi_comment_start_size, HIGHLIGHT_COMMENTS);
+	token = HIGHLIGHT_COMMENTS;
 	index += multi_comment_start_size;
 	in_comment = 1;
 	continue;
@@ -433,9 +2207,10 @@ static void highlight_row(Editor* editor, Row* row) {
 
     if (syntax->flags & HIGHLIGHT_STRINGS) {
       if (in_string) {
-	row->highlights[index] = HIGHLIGHT_STRING;
-	if (c == '\'' && index + 1 < row->rendered_size) {
-	  row->highlights[index + 1] = HIGHLIGHT_STRING;
+	mark(highlights, index, 1, HIGHLIGHT_STRING);
+	if (c == '\'' && index + 1 < size) {
+	  mark(highlights, index + 1, 1, HIGHLIGHT_STRING);
+	  token = HIGHLIGHT_STRING;
 	  index += 2;
 	  continue;
 	}
@@ -447,8 +2222,8 @@ static void highlight_row(Editor* editor, Row* row) {
 	continue;
       } else {
 	if (c == '"' || c == '\'') {
-	  in_string              = c;
-	  row->highlights[index] = HIGHLIGHT_STRING;
+	  in_string = c;
+	  mark(highlights, index, 1, HIGHLIGHT_STRING);
 	  index++;
 	  continue;
 	}
@@ -456,52 +2231,466 @@ static void highlight_row(Editor* editor, Row* row) {
     }
     
     if (syntax->flags & HIGHLIGHT_NUMBERS) {
-      int  previous_number    = previous_highlight == HIGHLIGHT_NUMBER;
       int  chained            = isdigit(c) && (previous_seperator || previous_number);
       if (chained || (c == '.' && previous_number)) {
-	row->highlights[index] = HIGHLIGHT_NUMBER;
+	mark(highlights, index, 1, HIGHLIGHT_NUMBER);
 	previous_seperator     = 0;
+	in_number              = 1;
 	index++;
 	continue;
       }
     }
 
-    if (previous_seperator) {
-      int found = 0;
-      for (int i = 0; keywords[i] != NULL; i++) {
-	char* keyword      = keywords[i];
-	int   keyword_size = strlen(keywords[i]);
-	int   is_keyword2  = keyword[keyword_size - 1] == '|';
-	if (is_keyword2) {
-	  keyword_size--;
-	}
+    if (previous_seperator) {
+      int highlight    = HIGHLIGHT_NORMAL;
+      int keyword_size = syntax->keyword_nodes == NULL
+	? match_keyword_list(syntax, &text[index], left, &highlight)
+	: match_keyword(syntax, &text[index], left, &highlight);
+
+      if (keyword_size > 0) {
+	mark(highlights, index, keyword_size, highlight);
+	token = highlight;
+	index += keyword_size;
+	previous_seperator = 0;
+	continue;
+      }
+    }
+
+    previous_seperator = seperators[(unsigned char)c];
+    index++;
+  }
+
+  lexer->previous_seperator = previous_seperator;
+  lexer->in_comment         = in_comment;
+  lexer->in_string          = in_string;
+  lexer->in_number          = in_number;
+  lexer->skip               = index - end;
+  lexer->skip_highlight     = lexer->skip > 0 ? token : HIGHLIGHT_NORMAL;
+}
+
+// Highlights `size` bytes of text that start inside a multi-line comment if
+// in_comment is set, and returns whether a comment is still open at the end.
+// Without highlights, this only works out the comment state.
+static int highlight_text(Syntax* syntax, char* text, int size, int in_comment, Spans* highlights) {
+  if (highlights != NULL) {
+    highlights->size = 0;
+  }
+
+  if (syntax == NULL) {
+    return 0;
+  }
+
+  Lexer lexer = { .in_comment = in_comment, .previous_seperator = 1 };
+  lex_text(syntax, text, size, 0, size, &lexer, highlights);
+  return lexer.in_comment;
+}
+
+static void highlight_row(Editor* editor, Row* row, int y) {
+  long start      = profile_clock();
+  int  in_comment = y > 0 && get_row(editor, y - 1)->open_comment;
+  highlight_text(editor->syntax, row->rendered, row->rendered_size, in_comment, &row->highlights);
+  profile(PROFILE_HIGHLIGHT, start);
+}
+
+static int is_long_row(Row* row) {
+  return row->chunks != NULL || row->size > CHUNK_ROW;
+}
+
+static int count_tabs(char* text, int size) {
+  int   tabs = 0;
+  char* end  = text + size;
+  while ((text = memchr(text, '\t', end - text)) != NULL) {
+    tabs++;
+    text++;
+  }
+  return tabs;
+}
+
+// Returns the column that `size` bytes of text starting at `column` end on.
+static int end_column(char* text, int size, int column) {
+  for (int i = 0; i < size; i++) {
+    if (text[i] == '\t') {
+      column += TAB_STOP - column % TAB_STOP;
+    } else {
+      column++;
+    }
+  }
+  return column;
+}
+
+// Cuts a long row into chunks. Their columns and lexer states are worked out
+// as they are needed.
+static void split_chunks(Row* row) {
+  if (!row->plain) {
+    pool_free(row->rendered, row->rendered_capacity);
+  }
+  pool_free(row->highlights.data, sizeof(Span) * row->highlights.capacity);
+  row->plain             = 0;
+  row->rendered          = NULL;
+  row->rendered_size     = 0;
+  row->rendered_capacity = 0;
+  memset(&row->highlights, 0, sizeof(Spans));
+
+  Chunks* chunks   = calloc(1, sizeof(Chunks));
+  chunks->capacity = row->size / CHUNK_SIZE + 2;
+  chunks->data     = calloc(chunks->capacity, sizeof(Chunk));
+  for (int start = 0; start < row->size || chunks->size == 0; start += CHUNK_SIZE) {
+    Chunk* chunk = &chunks->data[chunks->size];
+    chunk->start = start;
+    chunk->size  = row->size - start < CHUNK_SIZE ? row->size - start : CHUNK_SIZE;
+    chunk->tabs  = count_tabs(&row->data[start], chunk->size);
+    chunks->size++;
+  }
+  chunks->data[chunks->size].start = row->size;
+  chunks->laid_out                 = 1;
+  chunks->edited                   = -1;
+  row->chunks                      = chunks;
+}
+
+// Returns the chunk that holds byte `at`, or the last one for the end of the
+// row.
+static int find_chunk(Chunks* chunks, int at) {
+  int first = 0;
+  int last  = chunks->size - 1;
+  while (first < last) {
+    int middle = (first + last + 1) / 2;
+    if (chunks->data[middle].start <= at) {
+      first = middle;
+    } else {
+      last = middle - 1;
+    }
+  }
+  return first;
+}
+
+// Works out the checkpoints of chunk `at`, which needs a current column,
+// and returns the column it ends on.
+static int measure_chunk(Row* row, int at) {
+  Chunk* chunk = &row->chunks->data[at];
+  if (chunk->tabs == 0) {
+    return chunk->column + chunk->size;
+  }
+
+  int size           = sizeof(int) * (chunk->size / CHECKPOINT + 1);
+  chunk->checkpoints = pool_resize(chunk->checkpoints, &chunk->checkpoints_capacity, size);
+  int column         = chunk->column;
+  for (int i = 0; i <= chunk->size; i += CHECKPOINT) {
+    chunk->checkpoints[i / CHECKPOINT] = column - chunk->column;
+    column = end_column(&row->data[chunk->start + i], chunk->size - i < CHECKPOINT ? chunk->size - i : CHECKPOINT, column);
+  }
+  return column;
+}
+
+// Works out the column of the first chunk that doesn't have one yet, and
+// the checkpoints of the one before it. A chunk's checkpoints are current
+// once the chunk after it is laid out.
+static void lay_out_chunk(Row* row) {
+  Chunks* chunks = row->chunks;
+  Chunk*  next   = &chunks->data[chunks->laid_out];
+  int     column = measure_chunk(row, chunks->laid_out - 1);
+  if (next->tabs > 0 && next->column % TAB_STOP != column % TAB_STOP) {
+    next->stamp = 0;
+  }
+  next->column = column;
+  chunks->laid_out++;
+}
+
+static int same_lexer(Lexer* a, Lexer* b) {
+  return memcmp(a, b, sizeof(Lexer)) == 0;
+}
+
+// Brings the lexer states of the chunks up to chunk `last` up to date, for a
+// row that starts in a comment if in_comment is set. Chunk `size` holds the
+// state the row ends in.
+static void lex_chunks(Editor* editor, Row* row, int in_comment, int last) {
+  Chunks* chunks = row->chunks;
+  if (editor->syntax == NULL) {
+    chunks->data[chunks->size].lexer = (Lexer) {};
+    return;
+  }
+  if (chunks->generation != editor->generation) {
+    chunks->generation = editor->generation;
+    chunks->lexed      = 0;
+    chunks->known      = 0;
+  }
+  if (chunks->lexed == 0 || chunks->in_comment != in_comment) {
+    chunks->data[0].lexer = (Lexer) { .in_comment = in_comment, .previous_seperator = 1 };
+    chunks->data[0].stamp = 0;
+    chunks->in_comment    = in_comment;
+    chunks->lexed         = 1;
+  }
+
+  while (chunks->lexed <= last) {
+    int    at    = chunks->lexed - 1;
+    Chunk* chunk = &chunks->data[at];
+    Lexer  lexer = chunk->lexer;
+    lex_text(editor->syntax, row->data, row->size, chunk->start, chunk->start + chunk->size, &lexer, NULL);
+    chunks->lexed++;
+    if (same_lexer(&lexer, &chunk[1].lexer)) {
+      if (at + 1 < chunks->known && at + 1 > chunks->edited) {
+	chunks->lexed = chunks->known;
+      }
+    } else {
+      chunk[1].lexer = lexer;
+      chunk[1].stamp = 0;
+    }
+  }
+  if (chunks->lexed > chunks->edited) {
+    chunks->edited = -1;
+  }
+  if (chunks->lexed > chunks->known) {
+    chunks->known = chunks->lexed;
+  }
+}
+
+// Returns whether a comment is still open at the end of a long row.
+static int chunks_comment(Editor* editor, Row* row, int in_comment) {
+  if (row->chunks == NULL) {
+    split_chunks(row);
+  }
+  lex_chunks(editor, row, in_comment, row->chunks->size);
+  return row->chunks->data[row->chunks->size].lexer.in_comment;
+}
+
+static void split_chunk(Row* row, int at) {
+  Chunks* chunks = row->chunks;
+  if (chunks->size + 2 > chunks->capacity) {
+    chunks->capacity *= 2;
+    chunks->data      = realloc(chunks->data, sizeof(Chunk) * chunks->capacity);
+  }
+  memmove(&chunks->data[at + 2], &chunks->data[at + 1], sizeof(Chunk) * (chunks->size - at));
+  chunks->size++;
+
+  Chunk* chunk = &chunks->data[at];
+  Chunk* next  = chunk + 1;
+  int    half  = chunk->size / 2;
+  *next        = (Chunk) { .start = chunk->start + half, .size = chunk->size - half };
+  next->tabs   = count_tabs(&row->data[next->start], next->size);
+  chunk->size  = half;
+  chunk->tabs -= next->tabs;
+
+  // The new chunk ends where the old one did, so only the two halves have to
+  // be measured.
+  if (chunks->laid_out > at + 1) {
+    chunks->laid_out++;
+    next->column = measure_chunk(row, at);
+    measure_chunk(row, at + 1);
+  }
+
+  if (chunks->known > at + 1) {
+    chunks->known++;
+  }
+  if (chunks->edited > at) {
+    chunks->edited++;
+  }
+  if (chunks->edited < at + 1) {
+    chunks->edited = at + 1;
+  }
+}
+
+// Removes an empty chunk, whose column the next one takes over.
+static void remove_chunk(Row* row, int at) {
+  Chunks* chunks = row->chunks;
+  int     column = chunks->data[at].column;
+  free_chunk(&chunks->data[at]);
+  memmove(&chunks->data[at], &chunks->data[at + 1], sizeof(Chunk) * (chunks->size - at));
+  chunks->size--;
+
+  Chunk* next = &chunks->data[at];
+  if (next->tabs > 0 && next->column % TAB_STOP != column % TAB_STOP) {
+    next->stamp = 0;
+  }
+  next->column = column;
+  if (chunks->known > at) {
+    chunks->known--;
+  }
+  if (chunks->laid_out > at + 1) {
+    chunks->laid_out--;
+  }
+}
+
+// Keeps a long row's chunks in step with byte `c` having been inserted at
+// `at`, or removed from there if change is negative. Only the chunks around
+// the change have to be rendered and lexed again. The edited chunk is
+// measured again, and the chunks after it that were laid out move over by
+// however much its width changed. A chunk with tabs that moves by other than
+// whole tab stops changes width too, and is measured again. It ends on a
+// tab stop's phase of its own, so the chunks after it move by whole tab
+// stops, and at most one of them is measured again.
+static void edit_chunks(Row* row, int at, int change, char c) {
+  Chunks* chunks = row->chunks;
+  if (chunks == NULL) {
+    return;
+  }
+
+  int    edited = find_chunk(chunks, at);
+  int    first  = find_chunk(chunks, at > CHUNK_OVERLAP ? at - CHUNK_OVERLAP : 0);
+  Chunk* chunk  = &chunks->data[edited];
+  chunk->size  += change;
+  if (c == '\t') {
+    chunk->tabs += change;
+  }
+  for (int i = first; i <= edited; i++) {
+    chunks->data[i].stamp = 0;
+  }
+  for (int i = edited + 1; i <= chunks->size; i++) {
+    chunks->data[i].start += change;
+  }
+
+  if (chunks->laid_out > edited + 1) {
+    int shift = measure_chunk(row, edited) - chunks->data[edited + 1].column;
+    for (int i = edited + 1; i < chunks->laid_out && shift != 0; i++) {
+      Chunk* next = &chunks->data[i];
+      next->column += shift;
+      if (next->tabs > 0 && shift % TAB_STOP != 0) {
+	next->stamp = 0;
+	if (i + 1 < chunks->laid_out) {
+	  shift = measure_chunk(row, i) - chunks->data[i + 1].column;
+	}
+      }
+    }
+  }
+  if (chunks->lexed > first) {
+    chunks->lexed = first;
+  }
+  if (chunks->edited < edited) {
+    chunks->edited = edited;
+  }
+
+  if (chunk->size > 2 * CHUNK_SIZE) {
+    split_chunk(row, edited);
+  } else if (chunk->size == 0 && chunks->size > 1) {
+    remove_chunk(row, edited);
+  }
+}
 
-	if (strncmp(&row->rendered[index], keyword, keyword_size) == 0) {
-	  if (is_seperator(row->rendered[index + keyword_size])) {
-	    int highlight = is_keyword2 ? HIGHLIGHT_KEYWORD2 : HIGHLIGHT_KEYWORD1;
-	    memset(&row->highlights[index], highlight, keyword_size);
-	    index += keyword_size;
-	    found  = 1;
-	    break;
-	  }
-	}
+// Renders and highlights one chunk of a long row, which needs its column and
+// lexer state to be current.
+static void render_chunk(Editor* editor, Row* row, int at) {
+  long   start = profile_clock();
+  Chunk* chunk = &row->chunks->data[at];
+  char*  text  = &row->data[chunk->start];
+
+  chunk->rendered_size = chunk->size;
+  if (chunk->tabs > 0) {
+    int size = end_column(text, chunk->size, chunk->column) - chunk->column;
+    if (size > chunk->rendered_capacity) {
+      pool_free(chunk->rendered, chunk->rendered_capacity);
+      chunk->rendered_capacity = 0;
+      chunk->rendered          = pool_resize(NULL, &chunk->rendered_capacity, size);
+    }
+    int cursor = 0;
+    for (int i = 0; i < chunk->size; i++) {
+      if (text[i] == '\t') {
+	do {
+	  chunk->rendered[cursor] = ' ';
+	  cursor++;
+	} while ((chunk->column + cursor) % TAB_STOP != 0);
+      } else {
+	chunk->rendered[cursor] = text[i];
+	cursor++;
       }
+    }
+    chunk->rendered_size = cursor;
+  }
 
-      if (found) {
-	previous_seperator = 0;
+  Spans* spans = &chunk->highlights;
+  spans->size  = 0;
+  if (editor->syntax != NULL) {
+    long  lexed = profile_clock();
+    Lexer lexer = chunk->lexer;
+    lex_text(editor->syntax, row->data, row->size, chunk->start, chunk->start + chunk->size, &lexer, spans);
+
+    // Spans are found on the row's text, and are moved to the chunk's
+    // columns and cut off at its end.
+    int index  = 0;
+    int column = 0;
+    for (int i = 0; i < spans->size; i++) {
+      Span* span  = &spans->data[i];
+      int   first = span->start - chunk->start;
+      int   last  = first + span->size < chunk->size ? first + span->size : chunk->size;
+      if (chunk->tabs == 0) {
+	span->start = first;
+	span->size  = last - first;
 	continue;
       }
+      column      = end_column(&text[index], first - index, chunk->column + column) - chunk->column;
+      span->start = column;
+      column      = end_column(&text[first], last - first, chunk->column + column) - chunk->column;
+      span->size  = column - span->start;
+      index       = last;
     }
+    profile(PROFILE_HIGHLIGHT, lexed);
+  }
+  profile(PROFILE_RENDER, start);
+}
 
-    previous_seperator = is_seperator(c);
-    index++;
+static void stale_rows(Editor* editor, int start, int end) {
+  if (editor->stale_start >= editor->stale_end) {
+    editor->stale_start = start;
+    editor->stale_end   = end;
+  } else {
+    if (start < editor->stale_start) {
+      editor->stale_start = start;
+    }
+    if (end > editor->stale_end) {
+      editor->stale_end = end;
+    }
+  }
+}
+
+// Keeps the stale range on the same rows after `count` rows were inserted at
+// `at`, or removed from it if count is negative.
+static void shift_stale_rows(Editor* editor, int at, int count) {
+  if (editor->stale_start >= editor->stale_end) {
+    return;
+  }
+  if (editor->stale_start > at || (count > 0 && editor->stale_start == at)) {
+    editor->stale_start += count;
+  }
+  if (editor->stale_end > at) {
+    editor->stale_end += count;
+  }
+}
+
+// Recomputes the comment state carried out of stale rows, in order. A row
+// whose state changes makes the next one stale too, so the work stops as
+// soon as a row ends up in the same state as before. It also stops at row
+// `limit` or after `budget` rows, leaving the rest for later.
+static void update_comments(Editor* editor, int limit, int budget) {
+  int y = editor->stale_start;
+  if (y >= editor->stale_end) {
+    return;
+  }
+
+  int in_comment = y > 0 && get_row(editor, y - 1)->open_comment;
+  while (y < editor->stale_end && y < limit && budget > 0) {
+    Row* row         = get_row(editor, y);
+    int  out_comment = is_long_row(row)
+      ? chunks_comment(editor, row, in_comment)
+      : highlight_text(editor->syntax, row->data, row->size, in_comment, NULL);
+    if (out_comment != row->open_comment) {
+      row->open_comment = out_comment;
+      if (y + 1 < editor->row_count) {
+	get_row(editor, y + 1)->stamp = 0;
+	stale_rows(editor, y + 1, y + 2);
+      }
+    }
+    in_comment = out_comment;
+    y++;
+    budget--;
   }
+  editor->stale_start = y;
+}
 
-  int changed       = row->open_comment != in_comment;
-  row->open_comment = in_comment;
-  if (changed && row->index + 1 < editor->row_count) {
-    highlight_row(editor, &editor->row[row->index + 1]);
+// Marks a row's rendered text, highlights and comment state as stale.
+static void invalidate_row(Editor* editor, Row* row, int y) {
+  row->stamp = 0;
+  if (row->plain) {
+    row->plain    = 0;
+    row->rendered = NULL;
   }
+  stale_rows(editor, y, y + 1);
 }
 
 static void select_syntax(Editor* editor) {
@@ -512,7 +2701,7 @@ static void select_syntax(Editor* editor) {
 
   char* extension = strchr(editor->file_name, '.');
 
-  for (int i = 0; i < length(syntaxes); i++) {
+  for (int i = 0; i < syntax_count; i++) {
     char** file_match = syntaxes[i].file_match;
     for (int j = 0; file_match[j] != NULL; j++) {
       int is_extension = file_match[j][0] == '.';
@@ -522,30 +2711,59 @@ static void select_syntax(Editor* editor) {
 	  editor->syntax = &syntaxes[i];
 	  matched        = 1;
 	}
-      } else if (strcmp(editor->file_name, file_match[j])) {
+      } else if (strcmp(editor->file_name, file_match[j]) == 0) {
 	editor->syntax = &syntaxes[i];
 	matched        = 1;
       }
       if (matched) {
-	for (int i = 0; i < editor->row_count; i++) {
-	  highlight_row(editor, &editor->row[i]);
-	}
+	editor->generation++;
+	stale_rows(editor, 0, editor->row_count);
 	break;
       }
     }
   }
 }
 
-static void render_row(Editor* editor, Row* row) {
-  int tabs = 0;
+static void render_row(Editor* editor, Row* row, int y) {
+  if (is_long_row(row)) {
+    if (row->chunks == NULL) {
+      split_chunks(row);
+    }
+    return;
+  }
+
+  long start = profile_clock();
+  int  tabs  = 0;
   for (int i = 0; i < row->size; i++) {
     if (row->data[i] == '\t') {
       tabs++;
     }
   }
-  
-  free(row->rendered);
-  row->rendered = malloc(row->size + (TAB_STOP - 1) * tabs + 1);
+
+  if (tabs == 0) {
+    if (!row->plain) {
+      pool_free(row->rendered, row->rendered_capacity);
+    }
+    row->plain             = 1;
+    row->rendered          = row->data;
+    row->rendered_size     = row->size;
+    row->rendered_capacity = 0;
+    highlight_row(editor, row, y);
+    profile(PROFILE_RENDER, start);
+    return;
+  }
+  if (row->plain) {
+    row->plain    = 0;
+    row->rendered = NULL;
+  }
+
+  int size = row->size + (TAB_STOP - 1) * tabs + 1;
+  if (size > row->rendered_capacity) {
+    pool_free(row->rendered, row->rendered_capacity);
+    row->rendered          = NULL;
+    row->rendered_capacity = 0;
+  }
+  row->rendered = pool_resize(row->rendered, &row->rendered_capacity, size);
 
   int cursor = 0;
   for (int i = 0; i < row->size; i++) {
@@ -562,230 +2780,1171 @@ static void render_row(Editor* editor, Row* row) {
   row->rendered[cursor] = 0;
   row->rendered_size    = cursor;
 
-  highlight_row(editor, row);
+  highlight_row(editor, row, y);
+  profile(PROFILE_RENDER, start);
+}
+
+// Renders and highlights a row only if what was cached for it is stale.
+static void cache_row(Editor* editor, Row* row, int y) {
+  if (row->stamp != editor->generation) {
+    render_row(editor, row, y);
+    row->stamp = editor->generation;
+  }
+}
+
+static Row* new_row(char* text, int text_size) {
+  Row* row        = alloc_row();
+  row->count      = 1;
+  row->priority   = next_priority();
+  row->references = 1;
+  row->size     = text_size;
+  row->data     = pool_resize(NULL, &row->capacity, text_size + 1);
+  memcpy(row->data, text, text_size);
+  row->data[text_size] = 0;
+  return row;
+}
+
+static void insert_row(Editor* editor, char* text, int text_size, int at) {
+  if (at < 0 || at > editor->row_count) {
+    return;
+  }
+
+  record_edit(editor, EDIT_INSERT_ROW, at, 0, text, text_size);
+  Row* row   = new_row(text, text_size);
+  editor->edits++;
+  Row* left  = NULL;
+  Row* right = NULL;
+  split_rows(editor->root, at, &left, &right);
+  editor->root = merge_rows(merge_rows(left, row), right);
+  editor->row_count++;
+
+  shift_stale_rows(editor, at, 1);
+  invalidate_row(editor, row, at);
+}
+
+static void append_row(Editor* editor, char* text, int text_size) {
+  insert_row(editor, text, text_size, editor->row_count);
+}
+
+static void join_rows(Buffer* text, Row* row) {
+  if (row != NULL) {
+    join_rows(text, row->left);
+    buffer_append(text, row->data, row->size);
+    buffer_append(text, "\n", 1);
+    join_rows(text, row->right);
+  }
+}
+
+// Deletes `count` rows from `at` with one split and one merge.
+static void delete_rows(Editor* editor, int at, int count) {
+  if (at < 0 || count <= 0 || at + count > editor->row_count) {
+    return;
+  }
+  Row* left  = NULL;
+  Row* rows  = NULL;
+  Row* right = NULL;
+  split_rows(editor->root, at, &left, &right);
+  split_rows(right, count, &rows, &right);
+
+  Buffer text = {};
+  join_rows(&text, rows);
+  record_edit(editor, EDIT_DELETE_ROWS, at, count, text.data, text.size - 1);
+  free(text.data);
+
+  editor->root       = merge_rows(left, right);
+  editor->row_count -= count;
+  editor->edits++;
+  release_rows(rows);
+  shift_stale_rows(editor, at, -count);
+  if (at < editor->row_count) {
+    invalidate_row(editor, get_row(editor, at), at);
+  }
+}
+
+static void delete_row(Editor* editor, int at) {
+  delete_rows(editor, at, 1);
+}
+
+// Gives a row that still points into the mapped file its own copy of the
+// text, so that it can be edited.
+static void unmap_row(Row* row) {
+  if (row->mapped) {
+    char* data = pool_resize(NULL, &row->capacity, row->size + 1);
+    memcpy(data, row->data, row->size);
+    data[row->size] = 0;
+    row->data   = data;
+    row->mapped = 0;
+  }
+}
+
+static void row_append_string(Editor* editor, int y, char* text, int text_size) {
+  Row* row  = edit_row(editor, y);
+  record_edit(editor, EDIT_APPEND_STRING, y, row->size, text, text_size);
+  unmap_row(row);
+  row->data = pool_resize(row->data, &row->capacity, row->size + text_size + 1);
+  memcpy(&row->data[row->size], text, text_size);
+  row->size += text_size;
+  row->data[row->size] = 0;
+  free_chunks(row);
+  invalidate_row(editor, row, y);
+}
+
+static void truncate_row(Editor* editor, int y, int size) {
+  Row* row = edit_row(editor, y);
+  if (size < row->size) {
+    record_edit(editor, EDIT_TRUNCATE_ROW, y, size, &row->data[size], row->size - size);
+    unmap_row(row);
+    row->size            = size;
+    row->data[row->size] = 0;
+    free_chunks(row);
+    invalidate_row(editor, row, y);
+  }
+}
+
+static void insert_char(Editor* editor, int y, int at, char c) {
+  Row* row = edit_row(editor, y);
+  unmap_row(row);
+  if (at < 0 || at > row->size) {
+    at = row->size;
+  }
+  record_edit(editor, EDIT_INSERT_CHAR, y, at, &c, 1);
+  row->data = pool_resize(row->data, &row->capacity, row->size + 2);
+  if (at != row->size) {
+    memmove(&row->data[at + 1], &row->data[at], row->size - at + 1);
+  }
+  row->size++;
+  row->data[at] = c;
+  edit_chunks(row, at, 1, c);
+  invalidate_row(editor, row, y);
+}
+
+static void delete_char(Editor* editor, int y, int at) {
+  Row* row = edit_row(editor, y);
+  if (0 <= at && at < row->size) {
+    char c = row->data[at];
+    record_edit(editor, EDIT_DELETE_CHAR, y, at, &c, 1);
+    unmap_row(row);
+    memmove(&row->data[at], &row->data[at + 1], row->size - at);
+    row->size--;
+    edit_chunks(row, at, -1, c);
+    invalidate_row(editor, row, y);
+  }
+}
+
+static int line_size(char* text, int size) {
+  int line = 0;
+  while (line < size && text[line] != '\n' && text[line] != '\r') {
+    line++;
+  }
+  return line;
+}
+
+static int line_break_size(char* text, int size) {
+  if (size >= 2 && text[0] == '\r' && text[1] == '\n') {
+    return 2;
+  }
+  return size > 0 ? 1 : 0;
+}
+
+// Inserts text at the cursor as one edit, for pastes. The current row is
+// changed once, and the rows for the other lines are built into a tree of
+// their own and merged in at once. Rows are only highlighted when drawn.
+static void insert_text(Editor* editor, char* text, int size) {
+  if (editor->cursor_y == editor->row_count) {
+    append_row(editor, "", 0);
+  }
+  int  y   = editor->cursor_y;
+  int  x   = editor->cursor_x;
+  Row* row = edit_row(editor, y);
+  unmap_row(row);
+  if (x > row->size) {
+    x = row->size;
+  }
+  record_edit(editor, EDIT_INSERT_TEXT, y, x, text, size);
+
+  int first = line_size(text, size);
+  if (first == size) {
+    row->data = pool_resize(row->data, &row->capacity, row->size + size + 1);
+    memmove(&row->data[x + size], &row->data[x], row->size - x + 1);
+    memcpy(&row->data[x], text, size);
+    row->size += size;
+    free_chunks(row);
+    invalidate_row(editor, row, y);
+    editor->cursor_x = x + size;
+    editor->dirty    = 1;
+    return;
+  }
+
+  int   tail_size = row->size - x;
+  char* tail      = malloc(tail_size + 1);
+  memcpy(tail, &row->data[x], tail_size);
+  row->data = pool_resize(row->data, &row->capacity, x + first + 1);
+  memcpy(&row->data[x], text, first);
+  row->size            = x + first;
+  row->data[row->size] = 0;
+  free_chunks(row);
+
+  int   rows_capacity = 64;
+  int   rows_size     = 0;
+  Row** rows          = malloc(sizeof(Row*) * rows_capacity);
+  int   cursor        = first;
+  int   last_size     = 0;
+  while (cursor < size) {
+    cursor   += line_break_size(&text[cursor], size - cursor);
+    last_size = line_size(&text[cursor], size - cursor);
+
+    if (rows_size == rows_capacity) {
+      rows_capacity *= 2;
+      rows           = realloc(rows, sizeof(Row*) * rows_capacity);
+    }
+    rows[rows_size] = new_row(&text[cursor], last_size);
+    rows_size++;
+    cursor += last_size;
+  }
+
+  Row* last  = rows[rows_size - 1];
+  last->data = pool_resize(last->data, &last->capacity, last->size + tail_size + 1);
+  memcpy(&last->data[last->size], tail, tail_size);
+  last->size            += tail_size;
+  last->data[last->size] = 0;
+  free(tail);
+
+  Row* left  = NULL;
+  Row* right = NULL;
+  split_rows(editor->root, y + 1, &left, &right);
+  editor->root       = merge_rows(merge_rows(left, build_rows(rows, rows_size)), right);
+  editor->row_count += rows_size;
+  free(rows);
+
+  shift_stale_rows(editor, y + 1, rows_size);
+  invalidate_row(editor, row, y);
+  stale_rows(editor, y, y + rows_size + 1);
+  editor->cursor_y = y + rows_size;
+  editor->cursor_x = last_size;
+  editor->dirty    = 1;
+}
+
+static int write_pieces(int fd, struct iovec* pieces, int count) {
+  while (count > 0) {
+    ssize_t written = writev(fd, pieces, count);
+    if (written == -1) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return -1;
+    }
+    while (count > 0 && written >= pieces->iov_len) {
+      written -= pieces->iov_len;
+      pieces++;
+      count--;
+    }
+    if (count > 0) {
+      pieces->iov_base  = (char*) pieces->iov_base + written;
+      pieces->iov_len  -= written;
+    }
+  }
+  return 0;
+}
+
+static void flush_pieces(Writer* writer) {
+  if (!writer->failed && write_pieces(writer->fd, writer->pieces, writer->piece_count) == -1) {
+    writer->failed = 1;
+  }
+  writer->piece_count = 0;
+  atomic_store(&writer->flushed, writer->written);
+  if (elapsed_milliseconds(&writer->woken) >= SAVE_PROGRESS) {
+    write(writer->wake, "", 1);
+    clock_gettime(CLOCK_MONOTONIC, &writer->woken);
+  }
+}
+
+static void add_piece(Writer* writer, char* data, size_t size) {
+  if (writer->piece_count > 0) {
+    struct iovec* last = &writer->pieces[writer->piece_count - 1];
+    if ((char*) last->iov_base + last->iov_len == data) {
+      last->iov_len   += size;
+      writer->written += size;
+      return;
+    }
+  }
+  if (writer->piece_count == SAVE_BATCH) {
+    flush_pieces(writer);
+  }
+  writer->pieces[writer->piece_count] = (struct iovec) { data, size };
+  writer->piece_count++;
+  writer->written += size;
+}
+
+static void write_piece(Writer* writer, char* data, size_t size) {
+  add_piece(writer, data, size);
+  if (writer->written - atomic_load(&writer->flushed) >= SAVE_CHUNK) {
+    flush_pieces(writer);
+  }
+}
+
+static long measure_rows(Row* row) {
+  if (row == NULL) {
+    return 0;
+  }
+  return measure_rows(row->left) + row->size + 1 + measure_rows(row->right);
+}
+
+static void write_rows(Writer* writer, Row* row) {
+  static char newline[] = "\n";
+  if (row != NULL && !writer->failed) {
+    write_rows(writer, row->left);
+    write_piece(writer, row->data, row->size);
+    char* end    = row->data + row->size;
+    int   in_map = row->mapped && end < writer->map_end && *end == '\n';
+    write_piece(writer, in_map ? end : newline, 1);
+    write_rows(writer, row->right);
+  }
+}
+
+// Writes the part of the mapped file that isn't in rows yet as its rows
+// would be written once indexed, ending each line with "\n" alone.
+static void write_tail(Writer* writer, char* tail, size_t size) {
+  static char newline[] = "\n";
+  char*       end       = tail + size;
+  while (tail < end && !writer->failed) {
+    char* line_end = memchr(tail, '\n', end - tail);
+    char* text_end = line_end == NULL ? end : line_end;
+    while (text_end > tail && text_end[-1] == '\r') {
+      text_end--;
+    }
+    write_piece(writer, tail, text_end - tail);
+    write_piece(writer, text_end == line_end ? line_end : newline, 1);
+    tail = line_end == NULL ? end : line_end + 1;
+  }
+}
+
+// Splits up to `budget` more bytes of the mapped file into rows, noting
+// which of them leave a comment open. The rows are built into a tree of
+// their own and merged onto the end in one go.
+static void index_editor(Editor* editor, size_t budget) {
+  char*  map   = editor->map;
+  size_t start = editor->map_indexed;
+  size_t end   = start + budget < editor->map_size ? start + budget : editor->map_size;
+
+  int   rows_capacity = 64;
+  int   rows_size     = 0;
+  Row** rows          = malloc(sizeof(Row*) * rows_capacity);
+  while (start < end) {
+    char*  newline = memchr(&map[start], '\n', editor->map_size - start);
+    size_t next    = newline == NULL ? editor->map_size : newline - map + 1;
+    size_t size    = (newline == NULL ? editor->map_size : newline - map) - start;
+    while (size > 0 && map[start + size - 1] == '\r') {
+      size--;
+    }
+
+    if (rows_size == rows_capacity) {
+      rows_capacity *= 2;
+      rows           = realloc(rows, sizeof(Row*) * rows_capacity);
+    }
+    Row* row        = alloc_row();
+    row->priority   = next_priority();
+    row->references = 1;
+    row->data       = &map[start];
+    row->size       = size;
+    row->mapped     = 1;
+    rows[rows_size] = row;
+    rows_size++;
+    start = next;
+  }
+
+  int in_comment = editor->row_count > 0 && get_row(editor, editor->row_count - 1)->open_comment;
+  for (int i = 0; i < rows_size; i++) {
+    Row* row          = rows[i];
+    row->open_comment = highlight_text(editor->syntax, row->data, row->size, in_comment, NULL);
+    in_comment        = row->open_comment;
+  }
+
+  editor->root         = merge_rows(editor->root, build_rows(rows, rows_size));
+  editor->row_count   += rows_size;
+  editor->map_indexed  = start;
+  free(rows);
+}
+
+static void find_journal(Editor* editor);
+
+static void open_editor(Editor* editor) {
+  select_syntax(editor);
+
+  int fd = open(editor->file_name, O_RDONLY);
+  if (fd == -1) {
+    die("open");
+  }
+
+  struct stat status = {};
+  if (fstat(fd, &status) == -1) {
+    die("fstat");
+  }
+
+  if (status.st_size > 0) {
+    editor->map = mmap(NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (editor->map == MAP_FAILED) {
+      die("mmap");
+    }
+    editor->map_size = status.st_size;
+    index_editor(editor, INDEX_SLICE);
+  }
+
+  close(fd);
+  find_journal(editor);
+}
+
+static void apply_edit(Editor* editor, Edit* edit, char* text) {
+  int operation = edit->operation;
+  if (operation == EDIT_INSERT_CHAR && edit->text_size == 1) {
+    insert_char(editor, edit->a, edit->b, text[0]);
+  }
+  if (operation == EDIT_DELETE_CHAR) {
+    delete_char(editor, edit->a, edit->b);
+  }
+  if (operation == EDIT_INSERT_ROW) {
+    insert_row(editor, text, edit->text_size, edit->a);
+  }
+  if (operation == EDIT_DELETE_ROWS) {
+    delete_rows(editor, edit->a, edit->b);
+  }
+  if (operation == EDIT_APPEND_STRING) {
+    row_append_string(editor, edit->a, text, edit->text_size);
+  }
+  if (operation == EDIT_TRUNCATE_ROW) {
+    truncate_row(editor, edit->a, edit->b);
+  }
+  if (operation == EDIT_INSERT_TEXT) {
+    editor->cursor_y = edit->a;
+    editor->cursor_x = edit->b;
+    insert_text(editor, text, edit->text_size);
+  }
+}
+
+// Takes back an edit with the primitives, so undoing is journaled like any
+// other edit. Undoing a paste deletes its rows in one go.
+static void reverse_edit(Editor* editor, Edit* edit, char* text) {
+  int operation = edit->operation;
+  int y         = edit->a;
+  if (operation == EDIT_INSERT_CHAR) {
+    delete_char(editor, y, edit->b);
+  }
+  if (operation == EDIT_DELETE_CHAR) {
+    insert_char(editor, y, edit->b, text[0]);
+  }
+  if (operation == EDIT_INSERT_ROW) {
+    delete_rows(editor, y, 1);
+  }
+  if (operation == EDIT_DELETE_ROWS) {
+    char* line = text;
+    char* end  = text + edit->text_size;
+    for (int i = 0; i < edit->b; i++) {
+      char* newline = memchr(line, '\n', end - line);
+      int   size    = newline == NULL ? end - line : newline - line;
+      insert_row(editor, line, size, y + i);
+      line += size + 1;
+    }
+  }
+  if (operation == EDIT_APPEND_STRING) {
+    truncate_row(editor, y, edit->b);
+  }
+  if (operation == EDIT_TRUNCATE_ROW) {
+    row_append_string(editor, y, text, edit->text_size);
+  }
+  if (operation == EDIT_INSERT_TEXT) {
+    int lines  = 0;
+    int last_x = edit->b + edit->text_size;
+    int cursor = line_size(text, edit->text_size);
+    while (cursor < edit->text_size) {
+      cursor += line_break_size(&text[cursor], edit->text_size - cursor);
+      last_x  = line_size(&text[cursor], edit->text_size - cursor);
+      cursor += last_x;
+      lines++;
+    }
+
+    Row*  last      = get_row(editor, y + lines);
+    int   tail_size = last->size - last_x;
+    char* tail      = malloc(tail_size + 1);
+    memcpy(tail, &last->data[last_x], tail_size);
+    delete_rows(editor, y + 1, lines);
+    truncate_row(editor, y, edit->b);
+    row_append_string(editor, y, tail, tail_size);
+    free(tail);
+  }
+}
+
+// Finds the edits of a step, which can only be walked forwards.
+static Edit** step_edits(History* history, Step* step, int* count) {
+  int    capacity = 16;
+  Edit** edits    = malloc(sizeof(Edit*) * capacity);
+  *count          = 0;
+  for (int at = step->start; at < step->end;) {
+    if (*count == capacity) {
+      capacity *= 2;
+      edits     = realloc(edits, sizeof(Edit*) * capacity);
+    }
+    Edit* edit     = (Edit*) &history->log.data[at];
+    edits[*count]  = edit;
+    (*count)++;
+    at += sizeof(Edit) + edit->text_size;
+    at += (sizeof(int) - at % sizeof(int)) % sizeof(int);
+  }
+  return edits;
+}
+
+// Edits made between begin_step and end_step undo as one step.
+static void begin_step(Editor* editor) {
+  History* history  = &editor->history;
+  history->open     = 0;
+  history->cursor_y = editor->cursor_y;
+  history->cursor_x = editor->cursor_x;
+}
+
+static void end_step(Editor* editor) {
+  History* history = &editor->history;
+  if (history->open) {
+    history->steps[history->current - 1].after_y = editor->cursor_y;
+    history->steps[history->current - 1].after_x = editor->cursor_x;
+    history->open = 0;
+  }
+}
+
+static void undo_editor(Editor* editor) {
+  History* history = &editor->history;
+  if (history->current == 0) {
+    set_message(editor, "Nothing to undo");
+    return;
+  }
+  history->current--;
+  Step*  step  = &history->steps[history->current];
+  int    count = 0;
+  Edit** edits = step_edits(history, step, &count);
+  history->paused = 1;
+  for (int i = count - 1; i >= 0; i--) {
+    reverse_edit(editor, edits[i], (char*) (edits[i] + 1));
+  }
+  history->paused  = 0;
+  editor->cursor_y = step->cursor_y;
+  editor->cursor_x = step->cursor_x;
+  editor->dirty    = 1;
+  free(edits);
+}
+
+static void redo_editor(Editor* editor) {
+  History* history = &editor->history;
+  if (history->current == history->step_count) {
+    set_message(editor, "Nothing to redo");
+    return;
+  }
+  Step*  step  = &history->steps[history->current];
+  int    count = 0;
+  Edit** edits = step_edits(history, step, &count);
+  history->current++;
+  history->paused = 1;
+  for (int i = 0; i < count; i++) {
+    apply_edit(editor, edits[i], (char*) (edits[i] + 1));
+  }
+  history->paused  = 0;
+  editor->cursor_y = step->after_y;
+  editor->cursor_x = step->after_x;
+  editor->dirty    = 1;
+  free(edits);
+}
+
+static int read_number(unsigned char** cursor, unsigned char* end, unsigned long* number) {
+  *number = 0;
+  for (int shift = 0; *cursor < end && shift < 64; shift += 7) {
+    unsigned char byte = **cursor;
+    (*cursor)++;
+    *number |= (unsigned long) (byte & 0x7F) << shift;
+    if (!(byte & 0x80)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Applies the records of a journal, stopping at one that was cut short by
+// a crash. Returns how much of the journal was used.
+static long replay_journal(Editor* editor, unsigned char* journal, long size) {
+  unsigned char* cursor = journal + sizeof(JournalHeader);
+  unsigned char* end    = journal + size;
+  unsigned char* used   = cursor;
+  editor->journal_paused = 1;
+  editor->history.paused = 1;
+  while (cursor < end) {
+    unsigned long operation = 0;
+    unsigned long a         = 0;
+    unsigned long b         = 0;
+    unsigned long text_size = 0;
+    int complete =
+      read_number(&cursor, end, &operation) && read_number(&cursor, end, &a) &&
+      read_number(&cursor, end, &b) && read_number(&cursor, end, &text_size) &&
+      text_size <= end - cursor;
+    if (!complete) {
+      break;
+    }
+    Edit edit = { operation, a, b, text_size };
+    apply_edit(editor, &edit, (char*) cursor);
+    cursor += text_size;
+    used    = cursor;
+  }
+  editor->journal_paused = 0;
+  editor->history.paused = 0;
+  editor->cursor_y       = 0;
+  editor->cursor_x       = 0;
+  return used - journal;
+}
+
+// Looks for a journal left behind for the file as it is now on disk.
+static void find_journal(Editor* editor) {
+  char name[PATH_MAX];
+  journal_name(editor, name);
+  int fd = open(name, O_RDONLY);
+  if (fd == -1) {
+    return;
+  }
+
+  JournalHeader header   = {};
+  JournalHeader expected = {};
+  struct stat   status   = {};
+  journal_header(editor, &expected);
+  int found =
+    read(fd, &header, sizeof(header)) == sizeof(header) &&
+    memcmp(&header, &expected, sizeof(header)) == 0 &&
+    fstat(fd, &status) != -1 && status.st_size > sizeof(header);
+  editor->journal_found = found;
+  close(fd);
+}
+
+// Offers to replay a journal that find_journal found, and carries on
+// appending to it if it's replayed. Otherwise the journal is thrown away.
+static void recover_journal(Editor* editor) {
+  char* prompt = "Unsaved edits to this file were found. Recover them? (y/n) %s";
+  char* answer = ask(editor, prompt, NULL);
+  int   replay = answer != NULL && (answer[0] == 'y' || answer[0] == 'Y');
+  free(answer);
+  editor->journal_found = 0;
+  if (!replay) {
+    stop_journal(editor, 1);
+    return;
+  }
+
+  char name[PATH_MAX];
+  journal_name(editor, name);
+  int         fd     = open(name, O_RDWR | O_APPEND);
+  struct stat status = {};
+  if (fd == -1 || fstat(fd, &status) == -1) {
+    set_message(editor, "Can't read the journal: %s", strerror(errno));
+    return;
+  }
+  unsigned char* journal = malloc(status.st_size);
+  long           size    = pread(fd, journal, status.st_size, 0) == status.st_size ? status.st_size : 0;
+
+  while (editor->map_indexed < editor->map_size) {
+    index_editor(editor, INDEX_SLICE);
+  }
+  long used = size > 0 ? replay_journal(editor, journal, size) : 0;
+  free(journal);
+  if (used == 0 || ftruncate(fd, used) == -1) {
+    set_message(editor, "Can't read the journal: %s", used == 0 ? "it's damaged" : strerror(errno));
+    close(fd);
+    return;
+  }
+
+  editor->journal      = fd;
+  editor->journal_size = used;
+  editor->dirty        = 1;
+  clock_gettime(CLOCK_MONOTONIC, &editor->journal_committed);
+  set_message(editor, "Recovered %ld bytes of edits from %s", used - (long) sizeof(JournalHeader), name);
 }
 
-static void insert_row(Editor* editor, char* text, int text_size, int at) {
-  if (at < 0 || at > editor->row_count) {
+// Once a save is on disk, the journal only needs the edits made after the
+// save's snapshot, and those apply to the saved file.
+static void rebase_journal(Editor* editor, long offset) {
+  commit_journal(editor);
+  if (editor->journal == -1) {
     return;
   }
-  
-  if (editor->row == NULL) {
-    editor->row = malloc(sizeof(Row));
+  long  size = editor->journal_size - offset;
+  char* rest = malloc(size > 0 ? size : 1);
+  if (size <= 0 || pread(editor->journal, rest, size, offset) != size) {
+    size = 0;
+  }
+  stop_journal(editor, 0);
+  if (size > 0 && start_journal(editor)) {
+    buffer_append(&editor->journal_pending, rest, size);
+    editor->journal_size += size;
+    commit_journal(editor);
   } else {
-    editor->row = realloc(editor->row, sizeof(Row) * (editor->row_count + 1));
+    stop_journal(editor, 1);
   }
+  free(rest);
+}
 
-  if (at != editor->row_count) {
-    memmove(&editor->row[at + 1], &editor->row[at], sizeof(Row) * (editor->row_count - at));
-  }
+static void* run_save(void* argument) {
+  Save*   save   = argument;
+  Writer* writer = &save->writer;
+  atomic_store(&save->total, measure_rows(save->root) + save->tail_size);
 
-  for (int i = at + 1; i <= editor->row_count; i++) {
-    editor->row[i].index++;
+  write_rows(writer, save->root);
+  write_tail(writer, save->tail, save->tail_size);
+  flush_pieces(writer);
+
+  int saved = !writer->failed && fsync(writer->fd) != -1;
+  saved     = close(writer->fd) != -1 && saved;
+  saved     = saved && rename(save->temporary_name, save->file_name) != -1;
+  save->error = saved ? 0 : errno;
+  if (!saved) {
+    unlink(save->temporary_name);
   }
 
-  Row* row   = &editor->row[at];
-  memset(row, 0, sizeof(Row));
-  row->index = at;
-  row->size  = text_size;
-  row->data  = malloc(text_size + 1);
-  memcpy(row->data, text, text_size);
-  row->data[text_size] = 0;
+  save->milliseconds = elapsed_milliseconds(&save->start);
+  atomic_store(&save->done, 1);
+  write(writer->wake, "", 1);
+  return NULL;
+}
 
-  row->rendered      = NULL;
-  row->rendered_size = 0;
-  row->highlights    = NULL;
-  row->open_comment  = 0;
-  render_row(editor, row);
+// Reports on a save once it's done, waiting for it first if `wait` is set.
+// The editor only counts as saved if nothing was edited since the snapshot.
+static void finish_save(Editor* editor, int wait) {
+  Save* save = editor->save;
+  if (save == NULL || (!wait && !atomic_load(&save->done))) {
+    return;
+  }
 
-  editor->row_count++;
-}
+  pthread_join(save->thread, NULL);
+  if (save->error == 0) {
+    long written = save->writer.written;
+    set_message(
+      editor,
+      "%ld bytes written to disk in %.0f ms (%.1f MB/s)",
+      written,
+      save->milliseconds,
+      written / 1e3 / (save->milliseconds > 0 ? save->milliseconds : 1)
+    );
+    if (editor->edits == save->edits) {
+      editor->dirty = 0;
+      stop_journal(editor, 1);
+    } else {
+      rebase_journal(editor, save->journal_offset);
+    }
+  } else {
+    set_message(editor, "Can't save! I/O error: %s", strerror(save->error));
+  }
 
-static void append_row(Editor* editor, char* text, int text_size) {
-  insert_row(editor, text, text_size, editor->row_count);
+  release_rows(save->root);
+  free(save->file_name);
+  free(save);
+  editor->save = NULL;
 }
 
-static void delete_row(Editor* editor, int at) {
-  if (0 <= at && at < editor->row_count) {
-    Row* row = &editor->row[at];
-    free(row->data);
-    free(row->rendered);
-    memmove(row, &editor->row[at + 1], sizeof(Row) * (editor->row_count - at - 1));
-    for (int i = at + 1; i <= editor->row_count; i++) {
-      editor->row[i].index--;
+static void save_editor(Editor* editor) {
+  if (editor->file_name == NULL) {
+    editor->file_name = ask(editor, "Save as: %s (ESC to cancel)", NULL);
+    if (editor->file_name == NULL) {
+      set_message(editor, "Save aborted");
+      return;
     }
-    editor->row_count--;
+    select_syntax(editor);
+  }
+  
+  if (editor->save != NULL) {
+    set_message(editor, "Still saving, try again when it's done");
+    return;
   }
-}
 
-static void row_append_string(Editor* editor, Row* row, char* text, int text_size) {
-  row->data = realloc(row->data, row->size + text_size + 1);
-  memcpy(&row->data[row->size], text, text_size);
-  row->size += text_size;
-  row->data[row->size] = 0;
-  render_row(editor, row);
+  // The rows are written to a new file that's moved over the old one once
+  // it's safely on disk, so a failed save never leaves a truncated file.
+  // Unedited rows still point into the old file, which stays mapped.
+  Save* save = calloc(1, sizeof(Save));
+  snprintf(save->temporary_name, sizeof(save->temporary_name), "%s.XXXXXX", editor->file_name);
+  int fd = mkstemp(save->temporary_name);
+  if (fd == -1) {
+    set_message(editor, "Can't save! I/O error: %s", strerror(errno));
+    free(save);
+    return;
+  }
+  struct stat status = {};
+  fchmod(fd, stat(editor->file_name, &status) != -1 ? status.st_mode & 07777 : 0644);
+
+  clock_gettime(CLOCK_MONOTONIC, &save->start);
+  save->writer.fd      = fd;
+  save->writer.map_end = editor->map + editor->map_size;
+  save->writer.wake    = editor->wake[1];
+  save->writer.woken   = save->start;
+  save->root           = editor->root;
+  save->tail           = editor->map + editor->map_indexed;
+  save->tail_size      = editor->map_size - editor->map_indexed;
+  save->file_name      = strdup(editor->file_name);
+  save->edits          = editor->edits;
+  save->journal_offset = editor->journal == -1 ? sizeof(JournalHeader) : editor->journal_size;
+  retain_rows(save->root);
+
+  editor->save = save;
+  pthread_create(&save->thread, NULL, run_save, save);
 }
 
-static void insert_char(Editor* editor, Row* row, int at, char c) {
-  if (at < 0 || at > row->size) {
-    at = row->size;
+// Finds the first occurrence of query in text. With SSE2, sixteen positions
+// are tried at once by comparing the first and last bytes of the query, and
+// only positions where both match are compared in full. Whatever is left
+// over is filtered on the first byte with memchr.
+static char* find_text(char* text, size_t size, char* query, int query_size) {
+  if (query_size == 0 || query_size > size) {
+    return NULL;
   }
-  row->data = realloc(row->data, row->size + 2);
-  if (at != row->size) {
-    memmove(&row->data[at + 1], &row->data[at], row->size - at + 1);
+
+  size_t starts = size - query_size + 1;
+  size_t i      = 0;
+
+#ifdef __SSE2__
+  __m128i first = _mm_set1_epi8(query[0]);
+  __m128i last  = _mm_set1_epi8(query[query_size - 1]);
+  for (; i + 16 <= starts; i += 16) {
+    __m128i  firsts = _mm_cmpeq_epi8(first, _mm_loadu_si128((__m128i*) &text[i]));
+    __m128i  lasts  = _mm_cmpeq_epi8(last,  _mm_loadu_si128((__m128i*) &text[i + query_size - 1]));
+    unsigned mask   = _mm_movemask_epi8(_mm_and_si128(firsts, lasts));
+    while (mask != 0) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(&text[i + bit], query, query_size) == 0) {
+	return &text[i + bit];
+      }
+      mask &= mask - 1;
+    }
   }
-  row->size++;
-  row->data[at] = c;
-  render_row(editor, row);
+#endif
+
+  while (i < starts) {
+    char* candidate = memchr(&text[i], query[0], starts - i);
+    if (candidate == NULL) {
+      break;
+    }
+    if (memcmp(candidate, query, query_size) == 0) {
+      return candidate;
+    }
+    i = candidate - text + 1;
+  }
+  return NULL;
 }
 
-static void delete_char(Editor* editor, Row* row, int at) {
-  if (0 <= at && at < row->size) {
-    memmove(&row->data[at], &row->data[at + 1], row->size - at);
-    row->size--;
-    render_row(editor, row);
+static void add_match(Matches* matches, int y, int x) {
+  if (matches->size == matches->capacity) {
+    matches->capacity = matches->capacity == 0 ? 64 : matches->capacity * 2;
+    matches->data     = realloc(matches->data, sizeof(Match) * matches->capacity);
   }
+  matches->data[matches->size].y = y;
+  matches->data[matches->size].x = x;
+  matches->size++;
 }
 
-static char* rows_to_string(Editor* editor, int* size_out) {
-  int size = 0;
-  for (int i = 0; i < editor->row_count; i++) {
-    size += editor->row[i].size + 1;
-  }
-  char* result = malloc(size);
-  int   cursor = 0;
-  for (int i = 0; i < editor->row_count; i++) {
-    Row* row = &editor->row[i];
-    memcpy(&result[cursor], row->data, row->size);
-    result[cursor + row->size] = '\n';
-    cursor += row->size + 1;
-  }
-  *size_out = size;
-  return result;
+static void append_matches(Matches* matches, Matches* more) {
+  for (int i = 0; i < more->size; i++) {
+    add_match(matches, more->data[i].y, more->data[i].x);
+  }
 }
 
-static void open_editor(Editor* editor) {
-  select_syntax(editor);
-  
-  FILE* file = fopen(editor->file_name, "r");
-  if (file == NULL) {
-    die("fopen");
+// Unedited rows of a mapped file that follow each other, with only a line
+// ending between them, are searched as one run of text, and matches are
+// placed in rows by counting newlines. Runs are kept short enough to notice
+// quickly when the search is cancelled.
+typedef struct {
+  Search*         search;
+  Matches         batch;
+  struct timespec published;
+
+  char*           run;
+  size_t          run_size;
+  int             run_y;
+  int             run_mapped;
+} Scan;
+
+static void publish_matches(Scan* scan, int done) {
+  Search* search = scan->search;
+  pthread_mutex_lock(&search->lock);
+  append_matches(&search->found, &scan->batch);
+  search->done     = done;
+  int notify       = !search->notified;
+  search->notified = 1;
+  pthread_mutex_unlock(&search->lock);
+
+  scan->batch.size = 0;
+  clock_gettime(CLOCK_MONOTONIC, &scan->published);
+  if (notify) {
+    write(search->wake, "", 1);
   }
+}
 
-  char*  line          = NULL;
-  size_t line_capacity = 0;
-  while (1) {
-    ssize_t line_size = getline(&line, &line_capacity, file);
-    if (line_size == -1) {
+static void scan_run(Scan* scan) {
+  Search* search = scan->search;
+  char*   line   = scan->run;
+  int     line_y = scan->run_y;
+  char*   end    = scan->run + scan->run_size;
+  char*   cursor = scan->run;
+  while (cursor < end) {
+    char* match = find_text(cursor, end - cursor, search->query, search->query_size);
+    if (match == NULL) {
       break;
     }
-    while (line_size > 0) {
-      char c = line[line_size - 1];
-      if (c != '\n' && c != '\r') {
+    // Newlines are only looked for since the last match, so that a long
+    // line with many matches isn't scanned over and over.
+    while (1) {
+      char* newline = memchr(cursor, '\n', match - cursor);
+      if (newline == NULL) {
 	break;
       }
-      line_size--;
+      line   = newline + 1;
+      cursor = line;
+      line_y++;
     }
-    append_row(editor, line, line_size);
+    // Matches may overlap, as they do when narrowing a search keeps them.
+    add_match(&scan->batch, line_y, match - line);
+    cursor = match + 1;
   }
+  scan->run = NULL;
 
-  free(line);
-  fclose(file);
+  if (scan->batch.size > 0 && elapsed_milliseconds(&scan->published) >= SEARCH_PUBLISH) {
+    publish_matches(scan, 0);
+  }
 }
 
-static void save_editor(Editor* editor) {
-  if (editor->file_name == NULL) {
-    editor->file_name = ask(editor, "Save as: %s (ESC to cancel)", NULL);
-    if (editor->file_name == NULL) {
-      set_message(editor, "Save aborted");
-      return;
+static void scan_row(Scan* scan, Row* row, int y) {
+  char* run_end   = scan->run + scan->run_size;
+  int   continues =
+    scan->run != NULL && scan->run_mapped && row->mapped && scan->run_size < SEARCH_RUN &&
+    (row->data == run_end + 1 || (row->data == run_end + 2 && run_end[0] == '\r')) &&
+    row->data[-1] == '\n';
+  if (continues) {
+    scan->run_size = row->data + row->size - scan->run;
+  } else {
+    if (scan->run != NULL) {
+      scan_run(scan);
     }
-    select_syntax(editor);
+    scan->run        = row->data;
+    scan->run_size   = row->size;
+    scan->run_y      = y;
+    scan->run_mapped = row->mapped;
   }
-  
-  int   rows_size = 0;
-  char* rows      = rows_to_string(editor, &rows_size);
-
-  int fd = open(editor->file_name, O_RDWR | O_CREAT, 0644);
-  if (fd != -1) {
-    if (ftruncate(fd, rows_size) != -1) {
-      int bytes_written = write(fd, rows, rows_size);
-      if (bytes_written != -1) {
-	set_message(editor, "%d/%d bytes written to disk", bytes_written, rows_size);
-	editor->dirty = 0;
-      }
-    }
+}
+
+// Scans the rows from `start` up to `end` of the tree whose first row is y.
+static void scan_rows(Scan* scan, Row* row, int y, int start, int end) {
+  if (row == NULL || y >= end || y + row->count <= start) {
+    return;
   }
-  if (errno != 0) {
-    set_message(editor, "Can't save! I/O error: %s", strerror(errno));
+  if (atomic_load(&scan->search->cancelled)) {
+    return;
   }
-  if (fd != -1) {
-    close(fd);
+  scan_rows(scan, row->left, y, start, end);
+  y += count_rows(row->left);
+  if (start <= y && y < end) {
+    scan_row(scan, row, y);
+  }
+  scan_rows(scan, row->right, y + 1, start, end);
+}
+
+static void filter_matches(Scan* scan) {
+  Search* search = scan->search;
+  Row*    row    = NULL;
+  for (int i = 0; i < search->previous.size; i++) {
+    if (atomic_load(&search->cancelled)) {
+      return;
+    }
+    Match match = search->previous.data[i];
+    if (i == 0 || match.y != search->previous.data[i - 1].y) {
+      row = find_row(search->root, match.y);
+    }
+    // Matches in rows that are gone are dropped rather than looked at.
+    int fits = row != NULL && match.x + search->query_size <= row->size;
+    if (fits && memcmp(&row->data[match.x], search->query, search->query_size) == 0) {
+      add_match(&scan->batch, match.y, match.x);
+    }
+    if (i % 4096 == 0 && elapsed_milliseconds(&scan->published) >= SEARCH_PUBLISH) {
+      publish_matches(scan, 0);
+    }
   }
-  free(rows);
 }
 
-static int to_unrendered_index(Row* row, int target_render_index) {
-  int index        = 0;
-  int render_index = 0;
-  for (index = 0; index < row->size && render_index < target_render_index; index++) {
-    if (row->data[index] == '\t') {
-      render_index += (TAB_STOP - 1) - (render_index % TAB_STOP);
+static void* run_search(void* argument) {
+  Scan scan   = {};
+  scan.search = argument;
+  clock_gettime(CLOCK_MONOTONIC, &scan.published);
+
+  Search* search = scan.search;
+  if (search->filtering) {
+    filter_matches(&scan);
+  } else {
+    scan_rows(&scan, search->root, 0, search->origin, search->row_count);
+    if (scan.run != NULL) {
+      scan_run(&scan);
+    }
+    scan_rows(&scan, search->root, 0, 0, search->origin);
+    if (scan.run != NULL) {
+      scan_run(&scan);
     }
-    render_index++;
   }
-  return index;
+  publish_matches(&scan, 1);
+  free(scan.batch.data);
+  return NULL;
 }
 
-static void find_editor_callback(Editor* editor, char* query, int key) {
-  if (editor->saved_highlight != NULL) {
-    Row* row = &editor->row[editor->saved_highlight_line];
-    memcpy(row->highlights, editor->saved_highlight, row->rendered_size);
-    free(editor->saved_highlight);
-    editor->saved_highlight = NULL;
+static void stop_search(Editor* editor) {
+  Search* search = editor->search;
+  if (search != NULL) {
+    atomic_store(&search->cancelled, 1);
+    pthread_join(search->thread, NULL);
+    pthread_mutex_destroy(&search->lock);
+    release_rows(search->root);
+    free(search->query);
+    free(search->previous.data);
+    free(search->found.data);
+    free(search);
+    editor->search = NULL;
   }
-  
-  if (key == '\r' || key == 0x1B) {
+}
+
+static void start_search(Editor* editor, char* query, int filtering) {
+  Search* search     = calloc(1, sizeof(Search));
+  search->wake       = editor->wake[1];
+  search->root       = editor->root;
+  search->row_count  = editor->row_count;
+  search->query      = strdup(query);
+  search->query_size = strlen(query);
+  search->filtering  = filtering;
+  retain_rows(search->root);
+  pthread_mutex_init(&search->lock, NULL);
+
+  if (filtering) {
+    search->previous = editor->matches;
+    search->origin   = editor->match_origin;
+    memset(&editor->matches, 0, sizeof(Matches));
+  } else {
+    search->origin = editor->row_offset < editor->row_count ? editor->row_offset : 0;
+  }
+
+  editor->matches.size   = 0;
+  editor->match_index    = 0;
+  editor->match_origin   = search->origin;
+  editor->match_rows     = editor->row_count;
+  editor->match_complete = 0;
+  editor->search         = search;
+  pthread_create(&search->thread, NULL, run_search, search);
+}
+
+// Takes whatever the running search found since it was last asked, and
+// cleans up after it once it's done.
+static void collect_matches(Editor* editor) {
+  Search* search = editor->search;
+  if (search == NULL) {
     return;
   }
 
-  if (key == ARROW_RIGHT || key == ARROW_DOWN) {
-    editor->direction = 1;
-  } else if (key == ARROW_LEFT || key == ARROW_UP) {
-    editor->direction = -1;
+  pthread_mutex_lock(&search->lock);
+  append_matches(&editor->matches, &search->found);
+  search->found.size = 0;
+  search->notified   = 0;
+  int done           = search->done;
+  pthread_mutex_unlock(&search->lock);
+
+  if (done) {
+    stop_search(editor);
+    editor->match_complete = 1;
+  }
+}
+
+// Finds the matches on row y. Matches are sorted in two parts, the rows from
+// match_origin down and then the rows above it.
+static Match* row_matches(Editor* editor, int y, int* count) {
+  Match* data   = editor->matches.data;
+  int    low    = 0;
+  int    high   = editor->matches.size;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (data[middle].y >= editor->match_origin) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  if (y >= editor->match_origin) {
+    high = low;
+    low  = 0;
   } else {
-    editor->last_match = -1;
-    editor->direction  = 1;
+    high = editor->matches.size;
+  }
+  int end = high;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (data[middle].y < y) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
   }
 
-  if (editor->last_match == -1) {
-    editor->direction = 1;
+  int last = low;
+  while (last < end && data[last].y == y) {
+    last++;
   }
-  int current = editor->last_match;
-  
-  for (int i = 0; i < editor->row_count; i++) {
-    current += editor->direction;
-    if (current == -1) {
-      current = editor->row_count - 1;
-    } else if (current == editor->row_count) {
-      current = 0;
+  *count = last - low;
+  return &data[low];
+}
+
+static void show_match(Editor* editor) {
+  char* query = editor->match_query == NULL ? "" : editor->match_query;
+  int   more  =
+    editor->search != NULL || editor->match_rows < editor->row_count ||
+    editor->map_indexed < editor->map_size;
+  if (editor->matches.size == 0) {
+    char* status = editor->search != NULL ? "searching" : more ? "no matches yet" : "no matches";
+    set_message(editor, "Search: %s (%s) (ESC/Arrows/Enter)", query, status);
+    return;
+  }
+
+  Match match = editor->matches.data[editor->match_index];
+  set_message(
+    editor,
+    "Search: %s (%d of %d%s) (ESC/Arrows/Enter)",
+    query,
+    editor->match_index + 1,
+    editor->matches.size,
+    more ? "+" : ""
+  );
+  editor->cursor_y   = match.y;
+  editor->cursor_x   = match.x;
+  editor->row_offset = editor->row_count;
+}
+
+static void find_editor_callback(Editor* editor, char* query, int key) {
+  if (key == '\r' || key == 0x1B) {
+    stop_search(editor);
+    editor->matches.size = 0;
+    free(editor->match_query);
+    editor->match_query = NULL;
+    return;
+  }
+
+  int count = editor->matches.size;
+  if (key == WAKE_KEY) {
+    collect_matches(editor);
+  } else if (key == ARROW_RIGHT || key == ARROW_DOWN) {
+    if (count > 0) {
+      editor->match_index = (editor->match_index + 1) % count;
     }
-    
-    Row*  row   = &editor->row[current];
-    char* match = strstr(row->rendered, query);
-    if (match != NULL) {
-      editor->last_match = current;
-      editor->cursor_y   = current;
-      editor->cursor_x   = to_unrendered_index(row, match - row->rendered);
-      editor->row_offset = editor->row_count;
-
-      editor->saved_highlight_line = current;
-      editor->saved_highlight      = malloc(row->rendered_size);
-      memcpy(editor->saved_highlight, row->highlights, row->rendered_size);
-      memset(&row->highlights[match - row->rendered], HIGHLIGHT_MATCH, strlen(query));
-      break;
+  } else if (key == ARROW_LEFT || key == ARROW_UP) {
+    if (count > 0) {
+      editor->match_index = (editor->match_index + count - 1) % count;
     }
+  } else if (editor->match_query == NULL || strcmp(query, editor->match_query) != 0) {
+    char* previous = editor->match_query;
+    int   grew     = previous != NULL && strncmp(query, previous, strlen(previous)) == 0;
+    int   filter   = grew && editor->match_complete && editor->match_rows == editor->row_count;
+    stop_search(editor);
+    start_search(editor, query, filter);
+    free(previous);
+    editor->match_query = strdup(query);
   }
+
+  show_match(editor);
 }
 
 static void find_editor(Editor* editor) {
@@ -794,9 +3953,6 @@ static void find_editor(Editor* editor) {
   int column_offset = editor->column_offset;
   int row_offset    = editor->row_offset;
 
-  editor->last_match = -1;
-  editor->direction  = 1;
-
   char* query = ask(editor, "Search: %s (ESC/Arrows/Enter)", find_editor_callback);
   if (query == NULL) {
     editor->cursor_x	  = cursor_x;
@@ -809,23 +3965,36 @@ static void find_editor(Editor* editor) {
 }
 
 static void cursor_to_top_left() {
-  write(STDOUT_FILENO, "\x1b[H",  3);
+  finish_frame();
+  write(terminal_output, "\x1b[H",  3);
 }
 
 static void clear_screen() {
-  write(STDOUT_FILENO, "\x1b[2J", 4);
+  finish_frame();
+  write(terminal_output, "\x1b[2J", 4);
   cursor_to_top_left();
 }
 
 static void handle_key(Editor* editor, int c) {
   int row_size = 0;
   if (editor->cursor_y < editor->row_count) {
-    row_size = editor->row[editor->cursor_y].size;
+    row_size = get_row(editor, editor->cursor_y)->size;
   }
   
   if (c == CTRL_KEY('q')) {
+    finish_save(editor, 1);
     if (!editor->dirty || editor->quit_times == QUIT_TIMES) {
+      stop_journal(editor, 1);
       clear_screen();
+      if (editor->frame_stats && editor->frames > 0) {
+	fprintf(
+	  stderr,
+	  "%ld frames, %ld bytes written, %.1f bytes per frame\r\n",
+	  editor->frames,
+	  editor->bytes_written,
+	  (double) editor->bytes_written / editor->frames
+	);
+      }
       exit(EXIT_SUCCESS);
     }
     char* format =
@@ -842,6 +4011,15 @@ static void handle_key(Editor* editor, int c) {
   if (c == CTRL_KEY('s')) {
     save_editor(editor);
   }
+  if (c == CTRL_KEY('z')) {
+    undo_editor(editor);
+  }
+  if (c == CTRL_KEY('y')) {
+    redo_editor(editor);
+  }
+  if (c == CTRL_KEY('p')) {
+    editor->overlay = !editor->overlay;
+  }
   if (c == ARROW_UP && editor->cursor_y > 0) {
     editor->cursor_y--;
   }
@@ -867,78 +4045,405 @@ static void handle_key(Editor* editor, int c) {
   if (c == PAGE_UP) {
     editor->cursor_y = editor->row_offset;
   }
-  if (c == PAGE_DOWN) {
-    editor->cursor_y = editor->row_offset + editor->rows - 1;
-    if (editor->cursor_y > editor->rows) {
-      editor->cursor_y = editor->rows;
-    }
+  if (c == PAGE_DOWN) {
+    editor->cursor_y = editor->row_offset + editor->rows - 1;
+    if (editor->cursor_y > editor->rows) {
+      editor->cursor_y = editor->rows;
+    }
+  }
+  if (c == HOME_KEY) {
+    editor->cursor_x = 0;
+  }
+  if (c == END_KEY) {
+    if (editor->cursor_y < editor->row_count) {
+      editor->cursor_x = get_row(editor, editor->cursor_y)->size;
+    }
+  }
+  if (c == BACKSPACE || c == CTRL_KEY('h') || c == DELETE_KEY) {
+    if (c == DELETE_KEY) {
+      handle_key(editor, ARROW_RIGHT);
+    }
+    int in_bounds = editor->cursor_y < editor->row_count;
+    int is_origin = editor->cursor_x == 0 && editor->cursor_y == 0;
+    if (in_bounds && !is_origin) {
+      if (editor->cursor_x > 0) {
+	delete_char(editor, editor->cursor_y, editor->cursor_x - 1);
+	editor->cursor_x--;
+      } else {
+	Row* old_row = get_row(editor, editor->cursor_y);
+	Row* new_row = get_row(editor, editor->cursor_y - 1);
+	editor->cursor_x = new_row->size;
+	row_append_string(editor, editor->cursor_y - 1, old_row->data, old_row->size);
+	delete_row(editor, editor->cursor_y);
+	editor->cursor_y--;
+      }
+    }
+    editor->dirty = 1;
+  }
+  if (c == '\r') {
+    if (editor->cursor_x == 0) {
+      insert_row(editor, "", 0, editor->cursor_y);
+    } else {
+      Row*  row  = get_row(editor, editor->cursor_y);
+      char* line = &row->data[editor->cursor_x];
+      insert_row(editor, line, row->size - editor->cursor_x, editor->cursor_y + 1);
+      truncate_row(editor, editor->cursor_y, editor->cursor_x);
+    }
+    editor->cursor_y++;
+    editor->cursor_x = 0;
+  }
+  if (c == PASTE_KEY) {
+    read_paste(&editor->paste);
+    if (editor->paste.size > 0) {
+      insert_text(editor, editor->paste.data, editor->paste.size);
+    }
+  }
+  if (c < 128 && isprint(c)) {
+    if (editor->cursor_y == editor->row_count) {
+      append_row(editor, "", 0);
+    }
+    insert_char(editor, editor->cursor_y, editor->cursor_x, c);
+    editor->dirty = 1;
+    editor->cursor_x++;
+  }
+
+  row_size = 0;
+  if (editor->cursor_y < editor->row_count) {
+    row_size = get_row(editor, editor->cursor_y)->size;
+  }
+  if (editor->cursor_x > row_size) {
+    editor->cursor_x = row_size;
+  }
+}
+
+static int to_rendered_index(Row* row, int index) {
+  if (row->plain) {
+    return index < row->size ? index : row->size;
+  }
+  if (row->chunks != NULL) {
+    Chunks* chunks = row->chunks;
+    int     at     = find_chunk(chunks, index);
+    Chunk*  chunk  = &chunks->data[at];
+    while (chunks->laid_out <= (chunk->tabs > 0 ? at + 1 : at)) {
+      lay_out_chunk(row);
+    }
+    int size = index - chunk->start;
+    if (size < 0) {
+      size = 0;
+    }
+    if (size > chunk->size) {
+      size = chunk->size;
+    }
+    if (chunk->tabs == 0) {
+      return chunk->column + size;
+    }
+    int checkpoint = size / CHECKPOINT * CHECKPOINT;
+    return end_column(&row->data[chunk->start + checkpoint], size - checkpoint, chunk->column + chunk->checkpoints[size / CHECKPOINT]);
+  }
+  int rendered_index = 0;
+  for (int i = 0; i < index && i < row->size; i++) {
+    if (row->data[i] == '\t') {
+      rendered_index += (TAB_STOP - 1) - (rendered_index % TAB_STOP);
+    }
+    rendered_index++;
+  }
+  return rendered_index;
+}
+
+// Returns the index of the byte of a row drawn at rendered column `column`,
+// or the row's size past its end.
+static int to_data_index(Row* row, int column) {
+  if (row->plain) {
+    return column < row->size ? column : row->size;
+  }
+
+  char* text  = row->data;
+  int   size  = row->size;
+  int   index = 0;
+  int   start = 0;
+  if (row->chunks != NULL) {
+    Chunks* chunks = row->chunks;
+    while (chunks->laid_out <= chunks->size && chunks->data[chunks->laid_out - 1].column <= column) {
+      lay_out_chunk(row);
+    }
+    int first = 0;
+    int last  = chunks->laid_out - 2;
+    while (first < last) {
+      int middle = (first + last + 1) / 2;
+      if (chunks->data[middle].column <= column) {
+	first = middle;
+      } else {
+	last = middle - 1;
+      }
+    }
+
+    Chunk* chunk = &chunks->data[first];
+    text         = &row->data[chunk->start];
+    size         = chunk->size;
+    start        = chunk->column;
+    if (chunk->tabs == 0) {
+      index = column - chunk->column < size ? column - chunk->column : size;
+      return chunk->start + index;
+    }
+    int checkpoint  = 0;
+    int checkpoints = size / CHECKPOINT + 1;
+    while (checkpoint + 1 < checkpoints && chunk->column + chunk->checkpoints[checkpoint + 1] <= column) {
+      checkpoint++;
+    }
+    index = checkpoint * CHECKPOINT;
+    start = chunk->column + chunk->checkpoints[checkpoint];
+  }
+
+  while (index < size) {
+    int next = text[index] == '\t' ? start + TAB_STOP - start % TAB_STOP : start + 1;
+    if (next > column) {
+      break;
+    }
+    start = next;
+    index++;
+  }
+  return text - row->data + index;
+}
+
+static int highlight_color(int highlight) {
+  if (highlight == HIGHLIGHT_COMMENT || highlight == HIGHLIGHT_COMMENTS) {
+    return 36;
+  }
+  if (highlight == HIGHLIGHT_KEYWORD1) {
+    return 33;
+  }
+  if (highlight == HIGHLIGHT_KEYWORD2) {
+    return 32;
+  }
+  if (highlight == HIGHLIGHT_STRING) {
+    return 35;
+  }
+  if (highlight == HIGHLIGHT_NUMBER) {
+    return 31;
+  }
+  if (highlight == HIGHLIGHT_MATCH) {
+    return 34;
+  }
+  return STYLE_NORMAL;
+}
+
+static void put_text(Cell* line, int x, int columns, char* text, int size, int style) {
+  for (int i = 0; i < size && x + i < columns; i++) {
+    line[x + i] = (Cell) { text[i], style };
+  }
+}
+
+// Styles `size` cells from x, leaving alone any that fall outside the line.
+static void put_style(Cell* line, int x, int size, int columns, int style) {
+  int start = x < 0 ? 0 : x;
+  int end   = x + size < columns ? x + size : columns;
+  for (int i = start; i < end; i++) {
+    line[i].style = style;
+  }
+}
+
+static int same_cell(Cell a, Cell b) {
+  return a.symbol == b.symbol && a.style == b.style;
+}
+
+static void set_style(Buffer* buffer, int* current, int style) {
+  if (style == *current) {
+    return;
+  }
+  char command[16]  = {};
+  int  command_size = 0;
+  if ((*current & STYLE_INVERTED) && !(style & STYLE_INVERTED)) {
+    buffer_append(buffer, "\x1b[m", 3); // Reset formatting.
+    *current = STYLE_NORMAL;
+  }
+  if (!(*current & STYLE_INVERTED) && (style & STYLE_INVERTED)) {
+    buffer_append(buffer, "\x1b[7m", 4); // Invert colors.
   }
-  if (c == HOME_KEY) {
-    editor->cursor_x = 0;
+  if ((style & ~STYLE_INVERTED) != (*current & ~STYLE_INVERTED)) {
+    command_size = snprintf(command, sizeof(command), "\x1b[%dm", style & ~STYLE_INVERTED);
+    buffer_append(buffer, command, command_size);
   }
-  if (c == END_KEY) {
-    if (editor->cursor_y < editor->row_count) {
-      editor->cursor_x = editor->row[editor->cursor_y].size;
+  *current = style;
+}
+
+// Writes out the cells of the new frame that differ from what the terminal
+// shows. On each line, everything from the first changed cell to the last is
+// rewritten, and a blank end of the line is cleared instead.
+static void draw_changes(Editor* editor, int screen_rows) {
+  Buffer* buffer   = &editor->buffer;
+  int     columns  = editor->columns;
+  int     style    = STYLE_NORMAL;
+  int     cursor_y = -1;
+  int     cursor_x = -1;
+
+  for (int y = 0; y < screen_rows; y++) {
+    Cell* line  = &editor->screen[y * columns];
+    Cell* shown = &editor->shown[y * columns];
+
+    int first = 0;
+    while (first < columns && same_cell(line[first], shown[first])) {
+      first++;
     }
-  }
-  if (c == BACKSPACE || c == CTRL_KEY('h') || c == DELETE_KEY) {
-    if (c == DELETE_KEY) {
-      handle_key(editor, ARROW_RIGHT);
+    if (first == columns) {
+      continue;
     }
-    int in_bounds = editor->cursor_y < editor->row_count;
-    int is_origin = editor->cursor_x == 0 && editor->cursor_y == 0;
-    if (in_bounds && !is_origin) {
-      if (editor->cursor_x > 0) {
-	delete_char(editor, &editor->row[editor->cursor_y], editor->cursor_x - 1);
-	editor->cursor_x--;
-      } else {
-	Row* old_row = &editor->row[editor->cursor_y];
-	Row* new_row = &editor->row[editor->cursor_y - 1];
-	editor->cursor_x = new_row->size;
-	row_append_string(editor, new_row, old_row->data, old_row->size);
-	delete_row(editor, editor->cursor_y);
-	editor->cursor_y--;
+    int last = columns;
+    while (same_cell(line[last - 1], shown[last - 1])) {
+      last--;
+    }
+    int end = columns;
+    while (end > 0 && same_cell(line[end - 1], (Cell) { ' ', STYLE_NORMAL })) {
+      end--;
+    }
+
+    if (cursor_y != y || cursor_x != first) {
+      char move_cursor[32] = {};
+      int  move_size = snprintf(move_cursor, sizeof(move_cursor), "\x1b[%d;%dH", y + 1, first + 1);
+      buffer_append(buffer, move_cursor, move_size);
+    }
+    // Text in the same style goes out in one piece, after its SGR code.
+    int x    = first;
+    int stop = last < end ? last : end;
+    while (x < stop) {
+      int  run = x;
+      char text[columns];
+      while (run < stop && line[run].style == line[x].style) {
+	text[run - x] = line[run].symbol;
+	run++;
       }
+      set_style(buffer, &style, line[x].style);
+      buffer_append(buffer, text, run - x);
+      x = run;
     }
-    editor->dirty = 1;
+    if (last > end) {
+      set_style(buffer, &style, STYLE_NORMAL);
+      buffer_append(buffer, "\x1b[K", 3); // Clear line.
+    }
+    cursor_y = y;
+    cursor_x = x < columns ? x : -1;
   }
-  if (c == '\r') {
-    if (editor->cursor_x == 0) {
-      insert_row(editor, "", 0, editor->cursor_y);
+  set_style(buffer, &style, STYLE_NORMAL);
+
+  Cell* shown    = editor->shown;
+  editor->shown  = editor->screen;
+  editor->screen = shown;
+}
+
+// Shifts what the terminal shows of the text when the view has scrolled by
+// less than a screen, using a scroll region that leaves out the status and
+// message bars. Only the rows that came into view then differ from what's
+// shown, rather than every row. Rows that repeat can make the shift a loss,
+// so it's only done when fewer rows differ after it.
+static void scroll_shown(Editor* editor) {
+  int rows     = editor->rows;
+  int distance = editor->row_offset - editor->shown_offset;
+  editor->shown_offset = editor->row_offset;
+  if (distance == 0 || abs(distance) >= rows) {
+    return;
+  }
+
+  Cell* shown     = editor->shown;
+  int   columns   = editor->columns;
+  int   line_size = sizeof(Cell) * columns;
+  int   changed   = 0;
+  int   shifted   = 0;
+  for (int y = 0; y < rows; y++) {
+    Cell* line = &editor->screen[y * columns];
+    int   from = y + distance;
+    changed   += memcmp(line, &shown[y * columns], line_size) != 0;
+    shifted   += from < 0 || from >= rows || memcmp(line, &shown[from * columns], line_size) != 0;
+  }
+  if (shifted >= changed) {
+    return;
+  }
+
+  char scroll[48]  = {};
+  int  scroll_size = snprintf(
+    scroll,
+    sizeof(scroll),
+    "\x1b[1;%dr\x1b[%d%c\x1b[r",
+    rows,
+    abs(distance),
+    distance > 0 ? 'S' : 'T'
+  );
+  buffer_append(&editor->buffer, scroll, scroll_size);
+
+  int   kept    = (rows - abs(distance)) * columns;
+  Cell* blank   = shown;
+  if (distance > 0) {
+    memmove(shown, &shown[distance * columns], sizeof(Cell) * kept);
+    blank = &shown[kept];
+  } else {
+    memmove(&shown[-distance * columns], shown, sizeof(Cell) * kept);
+  }
+  for (int i = 0; i < abs(distance) * columns; i++) {
+    blank[i] = (Cell) { ' ', STYLE_NORMAL };
+  }
+}
+
+// Draws what is on screen of a long row, which only takes the chunks there.
+// Returns how many columns of the line it fills.
+static int draw_chunks(Editor* editor, Row* row, int y, Cell* line) {
+  Chunks* chunks = row->chunks;
+  int     left   = editor->column_offset;
+  int     right  = left + editor->columns;
+  while (chunks->laid_out <= chunks->size && chunks->data[chunks->laid_out - 1].column < right) {
+    lay_out_chunk(row);
+  }
+
+  int first = 0;
+  int last  = chunks->laid_out - 1 < chunks->size - 1 ? chunks->laid_out - 1 : chunks->size - 1;
+  while (first < last) {
+    int middle = (first + last + 1) / 2;
+    if (chunks->data[middle].column <= left) {
+      first = middle;
     } else {
-      Row*  row  = &editor->row[editor->cursor_y];
-      char* line = &row->data[editor->cursor_x];
-      insert_row(editor, line, row->size - editor->cursor_x, editor->cursor_y + 1);
-      
-      row                  = &editor->row[editor->cursor_y];
-      row->size            = editor->cursor_x;
-      row->data[row->size] = 0;
-      render_row(editor, row);
+      last = middle - 1;
     }
-    editor->cursor_y++;
-    editor->cursor_x = 0;
   }
-  if (isprint(c)) {
-    if (editor->cursor_y == editor->row_count) {
-      append_row(editor, "", 0);
-    }
-    insert_char(editor, &editor->row[editor->cursor_y], editor->cursor_x, c);
-    editor->dirty = 1;
-    editor->cursor_x++;
+  last = first;
+  while (last + 1 < chunks->size && chunks->data[last + 1].column < right) {
+    last++;
   }
+  lex_chunks(editor, row, y > 0 && get_row(editor, y - 1)->open_comment, last);
 
-  row_size = 0;
-  if (editor->cursor_y < editor->row_count) {
-    row_size = editor->row[editor->cursor_y].size;
-  }
-  if (editor->cursor_x > row_size) {
-    editor->cursor_x = row_size;
+  int size = 0;
+  for (int at = first; at <= last; at++) {
+    Chunk* chunk = &chunks->data[at];
+    if (chunk->stamp != editor->generation) {
+      render_chunk(editor, row, at);
+      chunk->stamp = editor->generation;
+    }
+
+    char* text = chunk->tabs > 0 ? chunk->rendered : &row->data[chunk->start];
+    int   from = left > chunk->column ? left - chunk->column : 0;
+    int   to   = right - chunk->column < chunk->rendered_size ? right - chunk->column : chunk->rendered_size;
+    for (int i = from; i < to; i++) {
+      line[chunk->column + i - left] = (Cell) { text[i], STYLE_NORMAL };
+    }
+    if (to > from) {
+      size = chunk->column + to - left;
+    }
+
+    Spans* spans = &chunk->highlights;
+    for (int i = 0; i < spans->size; i++) {
+      Span span = spans->data[i];
+      put_style(line, chunk->column + span.start - left, span.size, editor->columns, highlight_color(span.highlight));
+    }
   }
+  return size;
 }
 
 static void refresh_screen(Editor* editor) {
-  Buffer* buffer = &editor->buffer;
-  
+  long    start      = profile_clock();
+  long    highlights = profiles[PROFILE_HIGHLIGHT].calls;
+  Buffer* buffer     = &editor->buffer;
+  if (frame_pending()) {
+    editor->frame_owed = 1;
+    return;
+  }
+  editor->frame_owed = 0;
+
   int rows     = editor->rows;
   int columns  = editor->columns;
   int cursor_x = editor->cursor_x;
@@ -946,12 +4451,7 @@ static void refresh_screen(Editor* editor) {
 
   editor->rendered_x = 0;
   if (cursor_y < editor->row_count) {
-    for (int i = 0; i < cursor_x; i++) {
-      if (editor->row[cursor_y].data[i] == '\t') {
-	editor->rendered_x += (TAB_STOP - 1) - (editor->rendered_x % TAB_STOP);
-      }
-      editor->rendered_x++;
-    }
+    editor->rendered_x = to_rendered_index(get_row(editor, cursor_y), cursor_x);
   }
 
   if (cursor_y < editor->row_offset) {
@@ -967,69 +4467,70 @@ static void refresh_screen(Editor* editor) {
     editor->column_offset = editor->rendered_x - editor->columns + 1;
   }
   
-  buffer->size = 0;
-  buffer_append(buffer, "\x1b[?25l", 6); // Hide cursor while refreshing.
-  buffer_append(buffer, "\x1b[H",    3); // Move cursor to top left.
+  update_comments(editor, editor->row_offset + rows, FRAME_COMMENT_SLICE);
+
+  int screen_rows = rows + 2;
+  if (editor->screen == NULL) {
+    editor->screen = calloc(screen_rows * columns, sizeof(Cell));
+    editor->shown  = calloc(screen_rows * columns, sizeof(Cell));
+  }
+  for (int i = 0; i < screen_rows * columns; i++) {
+    editor->screen[i] = (Cell) { ' ', STYLE_NORMAL };
+  }
 
   for (int y = 0; y < rows; y++) {
-    int file_row = y + editor->row_offset;
+    Cell* line     = &editor->screen[y * columns];
+    int   file_row = y + editor->row_offset;
     
     if (file_row < editor->row_count) {
-      Row* row  = &editor->row[file_row];
-      int  size = row->rendered_size - editor->column_offset;
-      if (size < 0) {
-	size = 0;
-      }
-      if (size > editor->columns) {
-	size = editor->columns;
+      Row* row  = get_row(editor, file_row);
+      cache_row(editor, row, file_row);
+      int  size = 0;
+      if (row->chunks != NULL) {
+	size = draw_chunks(editor, row, file_row, line);
+      } else {
+	size = row->rendered_size - editor->column_offset;
+	if (size < 0) {
+	  size = 0;
+	}
+	if (size > editor->columns) {
+	  size = editor->columns;
+	}
+
+	char* text = &row->rendered[editor->column_offset];
+	for (int x = 0; x < size; x++) {
+	  line[x] = (Cell) { text[x], STYLE_NORMAL };
+	}
+	Spans* spans = &row->highlights;
+	for (int i = 0; i < spans->size; i++) {
+	  Span span = spans->data[i];
+	  put_style(line, span.start - editor->column_offset, span.size, size, highlight_color(span.highlight));
+	}
       }
-      int current_color = -1;
-      for (int i = editor->column_offset; i < size; i++) {
-	int highlight = row->highlights[i];
-	if (iscntrl(row->rendered[i])) {
-	  char symbol = (row->rendered[i] <= 26) ? ('@' + row->rendered[i]) : '?';
-	  buffer_append(buffer, "\x1b[7m", 4); // Invert colors.
-	  buffer_append(buffer, &symbol, 1);
-	  buffer_append(buffer, "\x1b[m", 3); // Reset formatting.
-	  if (current_color != -1) {
-	    char command[16]  = {};
-	    int  command_size = snprintf(command, sizeof(command), "\x1b[%dm", current_color);
-	    buffer_append(buffer, command, command_size);
-	  }
-	} else if (highlight == HIGHLIGHT_NORMAL) {
-	  buffer_append(buffer, "\x1b[39m", 5); // Default color.
-	  buffer_append(buffer, &row->rendered[i], 1);
-	  current_color = -1;
-	} else {
-	  int color = 39;
-	  if (highlight == HIGHLIGHT_COMMENT || highlight == HIGHLIGHT_COMMENTS) {
-	    color = 36;
-	  }
-	  if (highlight == HIGHLIGHT_KEYWORD1) {
-	    color = 33;
-	  }
-	  if (highlight == HIGHLIGHT_KEYWORD2) {
-	    color = 32;
-	  }
-	  if (highlight == HIGHLIGHT_STRING) {
-	    color = 35;
-	  }
-	  if (highlight == HIGHLIGHT_NUMBER) {
-	    color = 31;
-	  }
-	  if (highlight == HIGHLIGHT_MATCH) {
-	    color = 34;
-	  }	  
-	  if (color != current_color) {
-	    current_color     = color;
-	    char command[16]  = {};
-	    int  command_size = snprintf(command, sizeof(command), "\x1b[%dm", color);
-	    buffer_append(buffer, command, command_size);
+
+      // Search matches are drawn over the row's own highlights.
+      if (editor->matches.size > 0) {
+	int    match_count = 0;
+	Match* matches     = row_matches(editor, file_row, &match_count);
+	int    query_size  = strlen(editor->match_query);
+	int    first       = to_data_index(row, editor->column_offset);
+	for (int i = 0; i < match_count && matches[i].x < editor->column_offset + columns; i++) {
+	  if (matches[i].x + query_size <= first) {
+	    continue;
 	  }
-	  buffer_append(buffer, &row->rendered[i], 1);
+	  int start = to_rendered_index(row, matches[i].x);
+	  int end   = to_rendered_index(row, matches[i].x + query_size);
+	  put_style(line, start - editor->column_offset, end - start, size, highlight_color(HIGHLIGHT_MATCH));
+	}
+      }
+
+      for (int x = 0; x < size; x++) {
+	char symbol = line[x].symbol;
+	if (iscntrl(symbol)) {
+	  symbol  = (symbol <= 26) ? ('@' + symbol) : '?';
+	  line[x] = (Cell) { symbol, STYLE_NORMAL | STYLE_INVERTED };
 	}
       }
-      buffer_append(buffer, "\x1b[39m", 5); // Default color.
     } else {
       if (y == rows / 3) {
 	char* welcome      = "Editor1 -- Version " VERSION;
@@ -1041,33 +4542,44 @@ static void refresh_screen(Editor* editor) {
 
 	int padding = (columns - welcome_size) / 2;
 	if (padding > 0) {
-	  buffer_append(buffer, "~", 1);
-	  padding--;
-	}
-	while (padding > 0) {
-	  buffer_append(buffer, " ", 1);
-	  padding--;
+	  line[0].symbol = '~';
 	}
-      
-	buffer_append(buffer, welcome, welcome_size);
+	put_text(line, padding, columns, welcome, welcome_size, STYLE_NORMAL);
       } else {
-	buffer_append(buffer, "~", 1);
+	line[0].symbol = '~';
       }
     }
-    
-    buffer_append(buffer, "\x1b[K", 3); // Clear line.
-    buffer_append(buffer, "\r\n",   2);
   }
 
-  buffer_append(buffer, "\x1b[7m", 4); // Invert colors.
+  Cell* status_line = &editor->screen[rows * columns];
+  for (int x = 0; x < columns; x++) {
+    status_line[x].style = STYLE_NORMAL | STYLE_INVERTED;
+  }
   
   char  status[80]  = {};
   char* file_name   = editor->file_name == NULL ? "[No Name]" : editor->file_name;
   char* modified    = editor->dirty ? "(modified)" : "";
+  char* loading     = editor->map_indexed < editor->map_size ? "+" : "";
+  char  saving[32]  = {};
+  if (editor->save != NULL) {
+    long total   = atomic_load(&editor->save->total);
+    long flushed = atomic_load(&editor->save->writer.flushed);
+    snprintf(saving, sizeof(saving), " (saving %ld%%)", total > 0 ? flushed * 100 / total : 0);
+  }
   int   status_size = snprintf(
-    status, sizeof(status), "%.20s - %d lines %s", file_name, editor->row_count, modified
+    status,
+    sizeof(status),
+    "%.20s - %d%s lines %s%s",
+    file_name,
+    editor->row_count,
+    loading,
+    modified,
+    saving
   );
-  buffer_append(buffer, status, status_size);
+  if (status_size > columns) {
+    status_size = columns;
+  }
+  put_text(status_line, 0, columns, status, status_size, STYLE_NORMAL | STYLE_INVERTED);
 
   char right_status[80]  = {};
   int  right_status_size = snprintf(
@@ -1078,26 +4590,43 @@ static void refresh_screen(Editor* editor) {
     editor->cursor_y + 1,
     editor->row_count
   );
-
-  for (int i = status_size; i < editor->columns; i++) {
-    if (editor->columns - i == right_status_size) {
-      buffer_append(buffer, right_status, right_status_size);
-      break;
-    }
-    buffer_append(buffer, " ", 1);
+  if (status_size + right_status_size <= columns) {
+    int right = columns - right_status_size;
+    put_text(status_line, right, columns, right_status, right_status_size, STYLE_NORMAL | STYLE_INVERTED);
   }
-  buffer_append(buffer, "\x1b[m", 3); // Reset color.
-  buffer_append(buffer, "\r\n", 2);
 
-  buffer_append(buffer, "\x1b[K", 3); // Clear line.
-  int message_size = strlen(editor->message);
+  Cell* message_line = &editor->screen[(rows + 1) * columns];
+  int   message_size = strlen(editor->message);
   if (message_size > editor->columns) {
     message_size = editor->columns;
   }
-  if (message_size > 0 && time(NULL) - editor->message_time < 5) {
-    buffer_append(buffer, editor->message, message_size);
+  int message_shown = editor->prompting || time(NULL) - editor->message_time < MESSAGE_TIMEOUT;
+  if (message_size > 0 && message_shown) {
+    put_text(message_line, 0, columns, editor->message, message_size, STYLE_NORMAL);
   }
 
+  // The overlay shows the last frame, since this one isn't done yet.
+  if (editor->overlay) {
+    char overlay[80]  = {};
+    int  overlay_size = snprintf(
+      overlay,
+      sizeof(overlay),
+      " %.2f ms | %d bytes | %d highlighted ",
+      editor->frame_nanoseconds / 1e6,
+      editor->frame_bytes,
+      editor->frame_highlights
+    );
+    int at = columns - overlay_size;
+    put_text(message_line, at > 0 ? at : 0, columns, overlay, overlay_size, STYLE_NORMAL | STYLE_INVERTED);
+  }
+
+  // Terminals that know synchronized updates show the frame all at once.
+  buffer->size = 0;
+  buffer_append(buffer, "\x1b[?2026h", 8);
+  buffer_append(buffer, "\x1b[?25l", 6); // Hide cursor while refreshing.
+  scroll_shown(editor);
+  draw_changes(editor, screen_rows);
+
   int screen_y = cursor_y           - editor->row_offset    + 1;
   int screen_x = editor->rendered_x - editor->column_offset + 1;
   
@@ -1106,14 +4635,538 @@ static void refresh_screen(Editor* editor) {
   buffer_append(buffer, move_cursor, strlen(move_cursor));
   
   buffer_append(buffer, "\x1b[?25h", 6); // Show cursor after refreshing.
-  write(STDOUT_FILENO, buffer->data, buffer->size);
+  buffer_append(buffer, "\x1b[?2026l", 8);
+  frame         = buffer;
+  frame_written = 0;
+  flush_frame();
+
+  editor->frame_bytes    = buffer->size;
+  editor->bytes_written += buffer->size;
+  editor->frames++;
+  profile(PROFILE_REFRESH, start);
+  editor->frame_nanoseconds = profile_clock() - start;
+  editor->frame_highlights  = profiles[PROFILE_HIGHLIGHT].calls - highlights;
+}
+
+// Takes on the terminal's new size. Every cell of the next frame is drawn,
+// since the terminal may have moved or dropped what it showed.
+static void resize_editor(Editor* editor) {
+  int rows    = 0;
+  int columns = 0;
+  if (get_window_size(&rows, &columns) == -1 || rows < 3 || columns < 1) {
+    return;
+  }
+  editor->rows    = rows - 2;
+  editor->columns = columns;
+  free(editor->screen);
+  free(editor->shown);
+  editor->screen = NULL;
+  editor->shown  = NULL;
+}
+
+// Writes the counts and histograms of the profile to a file named after
+// the process.
+static void write_profile(Editor* editor) {
+  char name[PATH_MAX];
+  snprintf(name, sizeof(name), "/tmp/editor1.%d.profile", getpid());
+  FILE* file = fopen(name, "w");
+  if (file == NULL) {
+    set_message(editor, "Can't write the profile! I/O error: %s", strerror(errno));
+    return;
+  }
+
+  fprintf(file, "%ld frames, %ld bytes written\n", editor->frames, editor->bytes_written);
+  for (int i = 0; i < PROFILES; i++) {
+    Profile* counts = &profiles[i];
+    fprintf(
+      file,
+      "\n%s: %ld calls, %.3f ms, %.3f us per call\n",
+      profile_names[i],
+      counts->calls,
+      counts->nanoseconds / 1e6,
+      counts->calls > 0 ? counts->nanoseconds / 1e3 / counts->calls : 0.0
+    );
+    for (int j = 0; j < PROFILE_BUCKETS; j++) {
+      if (counts->buckets[j] > 0) {
+	fprintf(file, "  under %12.3f us %10ld\n", (2L << j) / 1e3, counts->buckets[j]);
+      }
+    }
+  }
+  fclose(file);
+  set_message(editor, "Profile written to %s", name);
+}
+
+// Keys that are already waiting are all handled before the next frame.
+static void run_editor(Editor* editor) {
+  while (1) {
+    if (!key_pending()) {
+      refresh_screen(editor);
+    }
+    int c = next_key(editor);
+
+    // A wake is no key press, only something new to draw, so it mustn't
+    // count as one between presses of Ctrl-Q.
+    if (c == WAKE_KEY) {
+      continue;
+    }
+    begin_step(editor);
+    handle_key(editor, c);
+    end_step(editor);
+  }
+}
+
+// Highlights the rows of a file over and over until `lines` lines have been
+// done, returning a checksum of the highlights.
+static unsigned highlight_lines(Syntax* syntax, Row** rows, int row_count, int lines, Spans* highlights) {
+  unsigned checksum   = 0;
+  int      in_comment = 0;
+  for (int i = 0; i < lines; i++) {
+    Row* row   = rows[i % row_count];
+    in_comment = highlight_text(syntax, row->data, row->size, in_comment, highlights);
+    for (int j = 0; j < highlights->size; j++) {
+      Span span = highlights->data[j];
+      checksum  = ((checksum * 31 + span.start) * 31 + span.size) * 31 + span.highlight;
+    }
+  }
+  return checksum;
+}
+
+static void benchmark_highlight(char* file_name, int lines) {
+  Editor editor    = { .generation = 1, .journal = -1 };
+  editor.file_name = file_name;
+  open_editor(&editor);
+  while (editor.map_indexed < editor.map_size) {
+    index_editor(&editor, INDEX_SLICE);
+  }
+  if (editor.syntax == NULL || editor.row_count == 0) {
+    fprintf(stderr, "%s: empty, or no syntax matches it\n", file_name);
+    exit(EXIT_FAILURE);
+  }
+
+  Row** rows  = malloc(sizeof(Row*) * editor.row_count);
+  long  bytes = 0;
+  for (int i = 0; i < editor.row_count; i++) {
+    rows[i] = get_row(&editor, i);
+  }
+  for (int i = 0; i < lines; i++) {
+    bytes += rows[i % editor.row_count]->size + 1;
+  }
+  Spans highlights = {};
+
+  Syntax list          = *editor.syntax;
+  Syntax trie          = *editor.syntax;
+  list.keyword_nodes   = NULL;
+  list.table           = NULL;
+  trie.table           = NULL;
+  struct timespec start = {};
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  unsigned list_checksum = highlight_lines(&list, rows, editor.row_count, lines, &highlights);
+  double   list_time     = elapsed_milliseconds(&start);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  unsigned trie_checksum = highlight_lines(&trie, rows, editor.row_count, lines, &highlights);
+  double   trie_time     = elapsed_milliseconds(&start);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  unsigned table_checksum = highlight_lines(editor.syntax, rows, editor.row_count, lines, &highlights);
+  double   table_time     = elapsed_milliseconds(&start);
+
+  LexTable* table = editor.syntax->table;
+  printf("%s: %d lines, %.1f MB\n", file_name, lines, bytes / 1e6);
+  printf("  keyword list: %8.1f ms\n", list_time);
+  printf("  keyword trie: %8.1f ms (%.2fx)\n", trie_time, list_time / trie_time);
+  printf("  state table:  %8.1f ms (%.2fx), %d states, %d classes\n", table_time, list_time / table_time,
+	 table->state_count, table->class_count);
+  if (list_checksum != trie_checksum || list_checksum != table_checksum) {
+    printf("  highlights differ!\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+#ifdef HEAP_STATS
+static void report_memory(char* stage, int lines) {
+  struct mallinfo2 heap = mallinfo2();
+  printf("  %-8s %8.1f heap bytes/line, %6.1f pooled, %6.1f reserved\n", stage,
+	 (double) (heap.uordblks + heap.hblkhd) / lines, (double) pool.used / lines, (double) pool.reserved / lines);
+}
+
+// Reports the heap used per line once a file is indexed, once every row has
+// been drawn, and once every row has been edited, along with the time to free
+// it all.
+static void benchmark_memory(char* file_name) {
+  Editor editor    = { .generation = 1, .journal = -1 };
+  editor.file_name = file_name;
+  open_editor(&editor);
+  while (editor.map_indexed < editor.map_size) {
+    index_editor(&editor, INDEX_SLICE);
+  }
+  int lines = editor.row_count > 0 ? editor.row_count : 1;
+  printf("%s: %d lines\n", file_name, editor.row_count);
+  report_memory("indexed", lines);
+
+  for (int i = 0; i < editor.row_count; i++) {
+    cache_row(&editor, get_row(&editor, i), i);
+  }
+  report_memory("drawn", lines);
+
+  for (int i = 0; i < editor.row_count; i++) {
+    Row* row = edit_row(&editor, i);
+    unmap_row(row);
+    row->data = pool_resize(row->data, &row->capacity, row->size + 2);
+    memmove(&row->data[1], row->data, row->size + 1);
+    row->data[0] = ' ';
+    row->size++;
+    render_row(&editor, row, i);
+  }
+  report_memory("edited", lines);
+
+  struct timespec start = {};
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  release_rows(editor.root);
+  printf("  freed in %.1f ms\n", elapsed_milliseconds(&start));
+}
+#endif
+
+#define REPLAY_OPEN    0
+#define REPLAY_TYPING  1
+#define REPLAY_NEWLINE 2
+#define REPLAY_SEARCH  3
+#define REPLAY_SCROLL  4
+#define REPLAY_SAVE    5
+#define REPLAY_KINDS   6
+
+static char* replay_kinds[] = { "open", "typing", "newline", "search", "scroll", "save" };
+
+// Commands of a replay script that send the same keys some number of times.
+typedef struct {
+  char* command;
+  char* keys;
+  int   kind;
+} ReplayCommand;
+
+static ReplayCommand replay_commands[] = {
+  { "backspace", "\x7f",    REPLAY_TYPING  },
+  { "newline",   "\r",      REPLAY_NEWLINE },
+  { "up",        "\x1b[A",  REPLAY_SCROLL  },
+  { "down",      "\x1b[B",  REPLAY_SCROLL  },
+  { "right",     "\x1b[C",  REPLAY_SCROLL  },
+  { "left",      "\x1b[D",  REPLAY_SCROLL  },
+  { "home",      "\x1b[H",  REPLAY_SCROLL  },
+  { "end",       "\x1b[F",  REPLAY_SCROLL  },
+  { "pageup",    "\x1b[5~", REPLAY_SCROLL  },
+  { "pagedown",  "\x1b[6~", REPLAY_SCROLL  },
+  { "save",      "\x13",    REPLAY_SAVE    },
+};
+
+typedef struct {
+  double* data;
+  int     size;
+  int     capacity;
+} Latencies;
+
+// A script of keys played to the editor in place of a terminal. Each command
+// in it comes down to a number of operations of one kind, and an operation
+// is timed from when its keys are sent until the editor is waiting for more
+// with nothing left to do, searches and saves included.
+struct Replay {
+  char*           script_name;
+  FILE*           script;
+  char*           line;
+  size_t          line_capacity;
+  int             line_number;
+  int             keys;
+  char*           file_name;
+
+  // The keys of the current command, and how many operations are left of
+  // it. Typing sends them a key at a time, everything else all at once.
+  Buffer          sequence;
+  int             one_by_one;
+  int             sent;
+  int             left;
+
+  int             kind;
+  int             timing;
+  struct timespec started;
+  Latencies       latencies[REPLAY_KINDS];
+};
+
+static void replay_error(Replay* replay, char* message) {
+  fprintf(stderr, "%s:%d: %s\n", replay->script_name, replay->line_number, message);
+  exit(EXIT_FAILURE);
+}
+
+// Reads the next line of the script that isn't blank or a comment, split
+// into its command and the rest. Returns 0 at the end of the script.
+static int next_line(Replay* replay, char** command, char** argument) {
+  ssize_t size = 0;
+  while ((size = getline(&replay->line, &replay->line_capacity, replay->script)) != -1) {
+    replay->line_number++;
+    while (size > 0 && (replay->line[size - 1] == '\n' || replay->line[size - 1] == '\r')) {
+      size--;
+    }
+    replay->line[size] = 0;
+    if (size == 0 || replay->line[0] == '#') {
+      continue;
+    }
+
+    char* space = strchr(replay->line, ' ');
+    *command    = replay->line;
+    *argument   = "";
+    if (space != NULL) {
+      *space    = 0;
+      *argument = space + 1;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+// Turns the next command of the script into the keys it sends. Returns 0 at
+// the end of the script.
+static int read_command(Replay* replay) {
+  char* command  = NULL;
+  char* argument = NULL;
+  if (!next_line(replay, &command, &argument)) {
+    return 0;
+  }
+
+  Buffer* sequence   = &replay->sequence;
+  sequence->size     = 0;
+  replay->one_by_one = 1;
+  replay->sent       = 0;
+  if (strcmp(command, "type") == 0) {
+    buffer_append(sequence, argument, strlen(argument));
+    replay->kind = REPLAY_TYPING;
+    replay->left = sequence->size;
+    return 1;
+  }
+  if (strcmp(command, "search") == 0) {
+    buffer_append(sequence, "\x06", 1);
+    buffer_append(sequence, argument, strlen(argument));
+    buffer_append(sequence, "\r", 1);
+    replay->kind = REPLAY_SEARCH;
+    replay->left = sequence->size;
+    return 1;
+  }
+
+  for (int i = 0; i < length(replay_commands); i++) {
+    ReplayCommand* known = &replay_commands[i];
+    if (strcmp(command, known->command) == 0) {
+      buffer_append(sequence, known->keys, strlen(known->keys));
+      replay->one_by_one = 0;
+      replay->kind       = known->kind;
+      replay->left       = *argument != 0 ? atoi(argument) : 1;
+      if (replay->left <= 0) {
+	replay_error(replay, "bad count");
+      }
+      return 1;
+    }
+  }
+  replay_error(replay, "unknown command");
+  return 0;
+}
+
+static int compare_latencies(const void* a, const void* b) {
+  double difference = *(double*) a - *(double*) b;
+  return difference < 0 ? -1 : difference > 0;
+}
+
+static void finish_replay(Editor* editor) {
+  Replay* replay = editor->replay;
+  finish_save(editor, 1);
+  stop_search(editor);
+  stop_journal(editor, 1);
+  unlink(replay->file_name);
+
+  printf("%s: %d lines, %dx%d\n", replay->script_name, editor->row_count, editor->rows + 2, editor->columns);
+  printf("  %-8s %6s %9s %9s %9s %9s\n", "", "count", "p50 ms", "p90 ms", "p99 ms", "max ms");
+  for (int i = 0; i < REPLAY_KINDS; i++) {
+    Latencies* latencies = &replay->latencies[i];
+    int        size      = latencies->size;
+    if (size == 0) {
+      continue;
+    }
+    qsort(latencies->data, size, sizeof(double), compare_latencies);
+    printf(
+      "  %-8s %6d %9.3f %9.3f %9.3f %9.3f\n",
+      replay_kinds[i],
+      size,
+      latencies->data[size / 2],
+      latencies->data[size * 9 / 10],
+      latencies->data[size * 99 / 100],
+      latencies->data[size - 1]
+    );
+  }
+  exit(EXIT_SUCCESS);
+}
+
+// Called when the editor has caught up and would wait for a key. Finishes
+// timing the last operation and sends the keys of the next one.
+static void step_replay(Editor* editor) {
+  Replay* replay = editor->replay;
+  if (replay->timing) {
+    Latencies* latencies = &replay->latencies[replay->kind];
+    if (latencies->size == latencies->capacity) {
+      latencies->capacity = latencies->capacity == 0 ? 64 : latencies->capacity * 2;
+      latencies->data     = realloc(latencies->data, sizeof(double) * latencies->capacity);
+    }
+    latencies->data[latencies->size] = elapsed_milliseconds(&replay->started);
+    latencies->size++;
+    replay->timing = 0;
+  }
+
+  while (replay->left == 0) {
+    if (!read_command(replay)) {
+      finish_replay(editor);
+    }
+  }
+  char* keys = replay->sequence.data;
+  int   size = replay->sequence.size;
+  if (replay->one_by_one) {
+    keys = &keys[replay->sent];
+    size = 1;
+  }
+  replay->sent++;
+  replay->left--;
+  replay->timing = 1;
+  clock_gettime(CLOCK_MONOTONIC, &replay->started);
+  if (write(replay->keys, keys, size) != size) {
+    die("write");
+  }
+}
+
+// Copies a file into a temporary one `copies` times over, keeping its
+// extension so that it's highlighted the same.
+static char* copy_file(char* file_name, int copies) {
+  char* extension = strrchr(file_name, '.');
+  if (extension == NULL || strchr(extension, '/') != NULL) {
+    extension = "";
+  }
+  char name[PATH_MAX];
+  snprintf(name, sizeof(name), "/tmp/editor1-replay-XXXXXX%s", extension);
+  int copy = mkstemps(name, strlen(extension));
+  int fd   = open(file_name, O_RDONLY);
+  if (copy == -1 || fd == -1) {
+    die(file_name);
+  }
+
+  struct stat status = {};
+  if (fstat(fd, &status) == -1) {
+    die(file_name);
+  }
+  char* text = malloc(status.st_size + 1);
+  if (read(fd, text, status.st_size) != status.st_size) {
+    die(file_name);
+  }
+  for (int i = 0; i < copies; i++) {
+    if (write(copy, text, status.st_size) != status.st_size) {
+      die(name);
+    }
+  }
+  close(fd);
+  close(copy);
+  free(text);
+  return strdup(name);
+}
+
+// Plays a script of keys to an editor with no terminal, drawing into `sink`,
+// and prints how long each kind of operation took. The script sets the
+// screen size and opens a file before anything else.
+static void replay_script(char* script_name, char* sink) {
+  Replay replay      = { .script_name = script_name, .kind = REPLAY_OPEN, .timing = 1 };
+  replay.script      = fopen(script_name, "r");
+  int keys[2]        = {};
+  if (replay.script == NULL) {
+    die(script_name);
+  }
+  if (pipe(keys) == -1) {
+    die("pipe");
+  }
+  terminal_input  = keys[0];
+  replay.keys     = keys[1];
+  terminal_output = open(sink, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (terminal_output == -1) {
+    die(sink);
+  }
+
+  Editor editor = { .generation = 1, .journal = -1, .replay = &replay, .rows = 24, .columns = 80 };
+  if (pipe(editor.wake) == -1) {
+    die("pipe");
+  }
+  fcntl(editor.wake[0], F_SETFL, O_NONBLOCK);
+
+  char* command  = NULL;
+  char* argument = NULL;
+  while (1) {
+    if (!next_line(&replay, &command, &argument)) {
+      replay_error(&replay, "no file to open");
+    }
+    if (strcmp(command, "size") == 0) {
+      if (sscanf(argument, "%d %d", &editor.rows, &editor.columns) != 2 || editor.rows < 3 || editor.columns < 1) {
+	replay_error(&replay, "bad size");
+      }
+    } else if (strcmp(command, "open") == 0) {
+      break;
+    } else {
+      replay_error(&replay, "open a file first");
+    }
+  }
+
+  char* space  = strchr(argument, ' ');
+  int   copies = 1;
+  if (space != NULL) {
+    *space = 0;
+    copies = atoi(space + 1);
+  }
+  replay.file_name = copy_file(argument, copies);
+  editor.file_name = replay.file_name;
+  editor.rows     -= 2;
+  clock_gettime(CLOCK_MONOTONIC, &replay.started);
+  open_editor(&editor);
+  run_editor(&editor);
 }
 
 int main(int argc, char** argv) {
+  compile_syntaxes();
+
+  if ((argc == 3 || argc == 4) && strcmp(argv[1], "--replay") == 0) {
+    replay_script(argv[2], argc == 4 ? argv[3] : "/dev/null");
+    return EXIT_SUCCESS;
+  }
+
+#ifdef HEAP_STATS
+  // One file at a time, since the pool and the heap outlive a benchmark.
+  if (argc == 3 && strcmp(argv[1], "--bench-memory") == 0) {
+    benchmark_memory(argv[2]);
+    return EXIT_SUCCESS;
+  }
+#endif
+
+  if (argc > 2 && strcmp(argv[1], "--bench-highlight") == 0) {
+    int lines = 1000000;
+    for (int i = 2; i < argc; i++) {
+      benchmark_highlight(argv[i], lines);
+    }
+    return EXIT_SUCCESS;
+  }
+
   enable_raw_mode();
 
-  Editor editor = {};
+  Editor editor = { .generation = 1, .journal = -1 };
+  if (pipe(editor.wake) == -1) {
+    die("pipe");
+  }
+  fcntl(editor.wake[0], F_SETFL, O_NONBLOCK);
+  signal_wake = editor.wake[1];
+  signal(SIGUSR1, request_profile);
+  signal(SIGWINCH, note_resize);
 
+  if (argc > 1 && strcmp(argv[1], "--frame-stats") == 0) {
+    editor.frame_stats = 1;
+    argc--;
+    argv++;
+  }
   if (argc > 1) {
     editor.file_name = argv[1];
     open_editor(&editor);
@@ -1124,11 +5177,9 @@ int main(int argc, char** argv) {
   }
   editor.rows -= 2;
 
-  set_message(&editor,"HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = search");
-  
-  while (1) {
-    refresh_screen(&editor);
-    int c = read_key();
-    handle_key(&editor, c);
+  set_message(&editor,"HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = search | Ctrl-Z/Y = undo/redo");
+  if (editor.journal_found) {
+    recover_journal(&editor);
   }
+  run_editor(&editor);
 }